@@ -339,7 +339,7 @@ lm32_top cpu(
 // BRAM/SRAM
 //---------------------------------------------------------------------------
 bram #(
-	.adr_width(14),
+	.adr_width(15),
 	.init0("../../../software/bios/bios.h0"),
 	.init1("../../../software/bios/bios.h1"),
 	.init2("../../../software/bios/bios.h2"),
@@ -359,7 +359,7 @@ bram #(
 );
 
 bram #(
-	.adr_width(14)
+	.adr_width(13)
 ) sram (
 	.sys_clk(sys_clk),
 	.sys_rst(sys_rst),
@@ -78,6 +78,22 @@ reg [31:0] compare0, compare1;
 wire match0 = (counter0 == compare0);
 wire match1 = (counter1 == compare1);
 
+/*
+ * Cycle counter
+ * Free-running from reset. Writing the low word takes a snapshot of
+ * both words, which are then read back without tearing.
+ */
+
+reg [63:0] cycles;
+reg [63:0] cycles_snapshot;
+
+always @(posedge sys_clk) begin
+	if(sys_rst)
+		cycles <= 64'd0;
+	else
+		cycles <= cycles + 64'd1;
+end
+
 /*
  * Logic and CSR interface
  */
@@ -103,6 +119,8 @@ always @(posedge sys_clk) begin
 		compare0 <= 32'hFFFFFFFF;
 		compare1 <= 32'hFFFFFFFF;
 
+		cycles_snapshot <= 64'd0;
+
 		hard_reset <= 1'b0;
 	end else begin
 		timer0_irq <= 1'b0;
@@ -146,6 +164,9 @@ always @(posedge sys_clk) begin
 					4'b1001: compare1 <= csr_di;
 					4'b1010: counter1 <= csr_di;
 
+					/* Cycle counter */
+					4'b1100: cycles_snapshot <= cycles;
+
 					4'b1111: hard_reset <= 1'b1;
 				endcase
 			end
@@ -166,6 +187,10 @@ always @(posedge sys_clk) begin
 				4'b1000: csr_do <= {ar1, en1};
 				4'b1001: csr_do <= compare1;
 				4'b1010: csr_do <= counter1;
+
+				/* Cycle counter */
+				4'b1100: csr_do <= cycles_snapshot[31:0];
+				4'b1101: csr_do <= cycles_snapshot[63:32];
 				
 				4'b1111: csr_do <= systemid;
 			endcase
@@ -18,7 +18,8 @@
 module uart #(
 	parameter csr_addr = 4'h0,
 	parameter clk_freq = 100000000,
-	parameter baud = 115200
+	parameter baud = 115200,
+	parameter fifo_depth = 4 /* log2 of the number of characters in each FIFO */
 ) (
 	input sys_clk,
 	input sys_rst,
@@ -28,8 +29,8 @@ module uart #(
 	input [31:0] csr_di,
 	output reg [31:0] csr_do,
 
-	output rx_irq,
-	output tx_irq,
+	output reg rx_irq,
+	output reg tx_irq,
 
 	input uart_rxd,
 	output uart_txd
@@ -37,8 +38,11 @@ module uart #(
 
 reg [15:0] divisor;
 wire [7:0] rx_data;
+wire rx_done;
 wire [7:0] tx_data;
 wire tx_wr;
+wire tx_done;
+wire enable16;
 
 uart_transceiver transceiver(
 	.sys_clk(sys_clk),
@@ -50,35 +54,150 @@ uart_transceiver transceiver(
 	.divisor(divisor),
 
 	.rx_data(rx_data),
-	.rx_done(rx_irq),
+	.rx_done(rx_done),
 
 	.tx_data(tx_data),
 	.tx_wr(tx_wr),
-	.tx_done(tx_irq)
+	.tx_done(tx_done),
+
+	.enable16(enable16)
 );
 
+parameter depth = 1 << fifo_depth;
+
 /* CSR interface */
 wire csr_selected = csr_a[13:10] == csr_addr;
+wire csr_write = csr_selected & csr_we;
+
+reg [fifo_depth:0] rx_threshold;
+reg [fifo_depth:0] tx_threshold;
+
+/*
+ * RX FIFO
+ * Reading the data register does not remove the character, because CSR
+ * reads have no strobe. The CPU instead writes the number of characters
+ * it has consumed to the RX level register.
+ */
+reg [7:0] rx_fifo[0:depth-1];
+reg [fifo_depth-1:0] rx_produce;
+reg [fifo_depth-1:0] rx_consume;
+reg [fifo_depth:0] rx_level;
+
+wire rx_push = rx_done & (rx_level != depth);
+wire rx_popreq = csr_write & (csr_a[2:0] == 3'd2);
+wire [fifo_depth:0] rx_pop = ~rx_popreq ? 0
+	: (csr_di > rx_level) ? rx_level
+	: csr_di[fifo_depth:0];
+
+always @(posedge sys_clk) begin
+	if(rx_push)
+		rx_fifo[rx_produce] <= rx_data;
+end
+
+always @(posedge sys_clk) begin
+	if(sys_rst) begin
+		rx_produce <= 0;
+		rx_consume <= 0;
+		rx_level <= 0;
+	end else begin
+		if(rx_push)
+			rx_produce <= rx_produce + 1;
+		rx_consume <= rx_consume + rx_pop;
+		rx_level <= rx_level + rx_push - rx_pop;
+	end
+end
+
+/*
+ * RX timeout: characters below the threshold are signaled once the
+ * line has been idle for 4 character times (640 enable16 ticks).
+ */
+parameter rx_timeout = 10'd640;
+reg [9:0] rx_idle;
 
-assign tx_data = csr_di[7:0];
-assign tx_wr = csr_selected & csr_we & (csr_a[0] == 1'b0);
+wire rx_timeout_event = enable16 & (rx_idle == rx_timeout - 10'd1) & (rx_level != 0);
+
+always @(posedge sys_clk) begin
+	if(sys_rst | rx_push | rx_popreq | (rx_level == 0))
+		rx_idle <= 10'd0;
+	else if(enable16 & (rx_idle != rx_timeout))
+		rx_idle <= rx_idle + 10'd1;
+end
+
+always @(posedge sys_clk) begin
+	if(sys_rst)
+		rx_irq <= 1'b0;
+	else
+		rx_irq <= (rx_push & (rx_level + 1 >= rx_threshold)) | rx_timeout_event;
+end
+
+/* TX FIFO */
+reg [7:0] tx_fifo[0:depth-1];
+reg [fifo_depth-1:0] tx_produce;
+reg [fifo_depth-1:0] tx_consume;
+reg [fifo_depth:0] tx_count;
+reg tx_busy;
+
+wire tx_push = csr_write & (csr_a[2:0] == 3'd0) & (tx_count != depth);
+wire tx_start = ~tx_busy & (tx_count != 0);
+
+assign tx_data = tx_fifo[tx_consume];
+assign tx_wr = tx_start;
+
+always @(posedge sys_clk) begin
+	if(tx_push)
+		tx_fifo[tx_produce] <= csr_di[7:0];
+end
+
+always @(posedge sys_clk) begin
+	if(sys_rst) begin
+		tx_produce <= 0;
+		tx_consume <= 0;
+		tx_count <= 0;
+		tx_busy <= 1'b0;
+		tx_irq <= 1'b0;
+	end else begin
+		if(tx_push)
+			tx_produce <= tx_produce + 1;
+		if(tx_start) begin
+			tx_consume <= tx_consume + 1;
+			tx_busy <= 1'b1;
+		end
+		if(tx_done)
+			tx_busy <= 1'b0;
+		tx_count <= tx_count + tx_push - tx_start;
+		/* A character has been sent and the FIFO is low enough */
+		tx_irq <= tx_done & (tx_count <= tx_threshold);
+	end
+end
 
 parameter default_divisor = clk_freq/baud/16;
 
 always @(posedge sys_clk) begin
 	if(sys_rst) begin
 		divisor <= default_divisor;
+		rx_threshold <= 1;
+		tx_threshold <= 0;
 		csr_do <= 32'd0;
 	end else begin
 		csr_do <= 32'd0;
 		if(csr_selected) begin
-			case(csr_a[0])
-				1'b0: csr_do <= rx_data;
-				1'b1: csr_do <= divisor;
+			case(csr_a[2:0])
+				3'd0: csr_do <= rx_fifo[rx_consume];
+				3'd1: csr_do <= divisor;
+				3'd2: csr_do <= rx_level;
+				/* Includes the character being sent */
+				3'd3: csr_do <= tx_count + tx_busy;
+				3'd4: csr_do <= rx_threshold;
+				3'd5: csr_do <= tx_threshold;
+				3'd6: csr_do <= depth;
+				default: csr_do <= 32'd0;
 			endcase
 			if(csr_we) begin
-				if(csr_a[0] == 1'b1)
-					divisor <= csr_di[15:0];
+				case(csr_a[2:0])
+					3'd1: divisor <= csr_di[15:0];
+					3'd4: rx_threshold <= csr_di[fifo_depth:0];
+					3'd5: tx_threshold <= csr_di[fifo_depth:0];
+				endcase
 			end
 		end
 	end
@@ -30,7 +30,9 @@ module uart_transceiver(
 
 	input [7:0] tx_data,
 	input tx_wr,
-	output reg tx_done
+	output reg tx_done,
+
+	output enable16
 );
 
 //-----------------------------------------------------------------
@@ -38,7 +40,6 @@ module uart_transceiver(
 //-----------------------------------------------------------------
 reg [15:0] enable16_counter;
 
-wire enable16;
 assign enable16 = (enable16_counter == 16'd0);
 
 always @(posedge sys_clk) begin
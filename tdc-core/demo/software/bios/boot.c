@@ -18,15 +18,23 @@
 #include <stdio.h>
 #include <console.h>
 #include <uart.h>
+#include <irq.h>
 #include <system.h>
 #include <board.h>
 #include <crc.h>
+#include <timer.h>
 #include <sfl.h>
+#include <lz4.h>
+#include <hw/uart.h>
 
 #include "boot.h"
 
 extern const struct board_desc *brd_desc;
 
+#ifdef SFL_EMULATOR
+/* Provided by the host-side device emulator, tools/sflemu.c */
+void __attribute__((noreturn)) boot(unsigned int r1, unsigned int r2, unsigned int r3, unsigned int addr);
+#else
 /*
  * HACK: by defining this function as not inlinable, GCC will automatically
  * put the values we want into the good registers because it has to respect
@@ -43,19 +51,28 @@ static void __attribute__((noinline)) __attribute__((noreturn)) boot(unsigned in
 		"call r4\n"
 	);
 }
+#endif
 
-/* Note that we do not use the hw timer so that this function works
- * even if the system controller has been disabled at synthesis.
+/* Time for the host to answer the request and to confirm a baud rate
+ * change, in milliseconds. The device must give up on the new rate
+ * before flterm does (BAUD_FALLBACK_DELAY).
  */
+#ifndef ACK_WINDOW
+#define ACK_WINDOW 1000
+#endif
+#ifndef BAUD_CONFIRM_WINDOW
+#define BAUD_CONFIRM_WINDOW 1000
+#endif
+
 static int check_ack()
 {
-	int timeout;
+	struct timer_window w;
 	int recognized;
 	static const char str[SFL_MAGIC_LEN] = SFL_MAGIC_ACK;
 	
-	timeout = 4500000;
+	timer_window_start(&w, ACK_WINDOW);
 	recognized = 0;
-	while(timeout > 0) {
+	while(!timer_window_expired(&w)) {
 		if(readchar_nonblock()) {
 			char c;
 			c = readchar();
@@ -70,16 +87,211 @@ static int check_ack()
 					recognized = 0;
 			}
 		}
-		timeout--;
+	}
+	return 0;
+}
+
+/* Waits for the host to confirm a baud rate change */
+static int check_baud_confirm()
+{
+	struct timer_window w;
+	int recognized;
+	static const char str[SFL_BAUD_CONFIRM_LEN] = SFL_BAUD_CONFIRM;
+	
+	timer_window_start(&w, BAUD_CONFIRM_WINDOW);
+	recognized = 0;
+	while(!timer_window_expired(&w)) {
+		if(readchar_nonblock()) {
+			char c;
+			c = readchar();
+			if(c == str[recognized]) {
+				recognized++;
+				if(recognized == SFL_BAUD_CONFIRM_LEN)
+					return 1;
+			} else {
+				if(c == str[0])
+					recognized = 1;
+				else
+					recognized = 0;
+			}
+		}
 	}
 	return 0;
 }
 
 #define MAX_FAILED 5
 
+/* Time without data after which the line is considered quiet again when
+ * recovering from a CRC error in windowed mode, in milliseconds. Hosts
+ * that stop sending on SFL_ACK_HOLD leave the line quiet right away, so
+ * this only has to cover the pauses of the host between frames.
+ */
+#ifndef DRAIN_IDLE
+#define DRAIN_IDLE 20
+#endif
+
+#define SUPPORTED_FEATURES (SFL_FEATURE_WINDOW|SFL_FEATURE_LARGE|SFL_FEATURE_COMPRESS \
+	|SFL_FEATURE_CRC32|SFL_FEATURE_FILL|SFL_FEATURE_BAUD|SFL_FEATURE_SELECTIVE)
+
+static int features;
+static unsigned char next_seq;
+/* Frames past next_seq that have already run, bit n for next_seq+n */
+static unsigned int done_mask;
+
+/*
+ * The frame being received, up to SFL_PAYLOAD_MAX bytes long. It is kept
+ * out of the stack, which shares the 8KB of SRAM with the BIOS data.
+ */
+static struct sfl_frame frame;
+
+void *boot_scratch(unsigned int *size)
+{
+	*size = sizeof(frame);
+	return &frame;
+}
+
+/* Address following the last LOAD frame, where the next one is expected */
+static unsigned int load_next;
+static int load_next_valid;
+
+static void fill(unsigned char *p, unsigned int length, unsigned char value)
+{
+	unsigned int word;
+	unsigned int *wp;
+
+	while((length > 0) && ((unsigned long)p & 3)) {
+		*(p++) = value;
+		length--;
+	}
+	word = value | (value << 8);
+	word |= word << 16;
+	wp = (unsigned int *)p;
+	while(length >= 16) {
+		wp[0] = word;
+		wp[1] = word;
+		wp[2] = word;
+		wp[3] = word;
+		wp += 4;
+		length -= 16;
+	}
+	while(length >= 4) {
+		*(wp++) = word;
+		length -= 4;
+	}
+	p = (unsigned char *)wp;
+	while(length-- > 0)
+		*(p++) = value;
+}
+
+static void drain_rx()
+{
+	struct timer_window w;
+
+	timer_window_start(&w, DRAIN_IDLE);
+	while(!timer_window_expired(&w)) {
+		if(readchar_nonblock()) {
+			readchar();
+			timer_window_start(&w, DRAIN_IDLE);
+		}
+	}
+}
+
+/*
+ * In windowed mode, checks the header CRC, which covers the length, the
+ * sequence number, the command and the first bytes of the payload.
+ */
+static int check_header(int head)
+{
+	unsigned short crc;
+	int i;
+
+	if(!(features & SFL_FEATURE_WINDOW))
+		return 1;
+	crc = crc16_byte(0, (frame.length & 0xff00) >> 8);
+	crc = crc16_byte(crc, frame.length & 0x00ff);
+	crc = crc16_byte(crc, frame.seq);
+	crc = crc16_byte(crc, frame.cmd);
+	for(i=0;i<head;i++)
+		crc = crc16_byte(crc, frame.payload[i]);
+	return crc == (((unsigned int)frame.hcrc[0] << 8)|frame.hcrc[1]);
+}
+
+/*
+ * Whether a frame with a good CRC is run. Frames ahead of the expected one
+ * are only run in selective mode, within the window. Older frames are
+ * retransmissions after a lost reply: they are run and acknowledged again.
+ */
+static int runnable(unsigned char seq)
+{
+	unsigned char ahead;
+
+	ahead = seq - next_seq;
+	if(ahead >= 128)
+		return 1;
+	if(features & SFL_FEATURE_SELECTIVE)
+		return ahead < SFL_WINDOW_MAX;
+	return ahead == 0;
+}
+
+/* Commands that only run once all older frames have run */
+static int in_order(unsigned char cmd)
+{
+	switch(cmd) {
+		case SFL_CMD_ABORT:
+		case SFL_CMD_JUMP:
+		case SFL_CMD_HELLO:
+		case SFL_CMD_BAUD:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* Shortest payload of the commands with fixed fields */
+static int min_length(unsigned char cmd)
+{
+	switch(cmd) {
+		case SFL_CMD_LOAD:
+		case SFL_CMD_JUMP:
+		case SFL_CMD_CMDLINE:
+		case SFL_CMD_INITRDSTART:
+		case SFL_CMD_INITRDEND:
+		case SFL_CMD_BAUD:
+			return 4;
+		case SFL_CMD_LOAD_COMPRESSED:
+		case SFL_CMD_CRC32:
+			return 8;
+		case SFL_CMD_FILL:
+			return 9;
+		default:
+			return 0;
+	}
+}
+
+static void reply(char code, unsigned char seq)
+{
+	writechar(code);
+	if(features & SFL_FEATURE_WINDOW)
+		writechar(seq);
+}
+
+static void reply_data(unsigned char seq, const unsigned char *data, int length)
+{
+	unsigned short crc;
+	int i;
+
+	crc = crc16(data, length);
+	reply(SFL_ACK_DATA, seq);
+	writechar((length & 0xff00) >> 8);
+	writechar(length & 0x00ff);
+	writechar((crc & 0xff00) >> 8);
+	writechar(crc & 0x00ff);
+	for(i=0;i<length;i++)
+		writechar(data[i]);
+}
+
 void serialboot()
 {
-	struct sfl_frame frame;
 	int failed;
 	unsigned int cmdline_adr, initrdstart_adr, initrdend_adr;
 	
@@ -91,51 +303,270 @@ void serialboot()
 	}
 	
 	failed = 0;
+	features = 0;
+	next_seq = 0;
+	done_mask = 0;
+	load_next_valid = 0;
 	cmdline_adr = initrdstart_adr = initrdend_adr = 0;
 	while(1) {
 		int i;
 		int actualcrc;
 		int goodcrc;
+		unsigned short crc;
+		unsigned char c;
+		unsigned char *direct;
+		int head;
+		int header;
+		unsigned char ahead;
 		
-		/* Grab one frame */
-		frame.length = readchar();
+		/* Grab one frame, computing its CRC as it arrives */
+		frame.length = (unsigned char)readchar();
+		if(features & SFL_FEATURE_LARGE)
+			frame.length = (frame.length << 8)|(unsigned char)readchar();
+		if(features & SFL_FEATURE_WINDOW) {
+			frame.hcrc[0] = readchar();
+			frame.hcrc[1] = readchar();
+		}
 		frame.crc[0] = readchar();
 		frame.crc[1] = readchar();
+		crc = 0;
+		if(features & SFL_FEATURE_WINDOW) {
+			frame.seq = readchar();
+			crc = crc16_byte(crc, frame.seq);
+		} else
+			frame.seq = next_seq;
 		frame.cmd = readchar();
-		for(i=0;i<frame.length;i++)
-			frame.payload[i] = readchar();
-		
-		/* Check CRC */
+		crc = crc16_byte(crc, frame.cmd);
 		actualcrc = ((int)frame.crc[0] << 8)|(int)frame.crc[1];
-		goodcrc = crc16(&frame.cmd, frame.length+1);
+		direct = NULL;
+		goodcrc = -1;
+		header = 0;
+		/* A corrupted length must not overflow the buffer */
+		if(frame.length <= sizeof(frame.payload)) {
+			head = frame.length < SFL_HEADER_PAYLOAD ? frame.length : SFL_HEADER_PAYLOAD;
+			for(i=0;i<head;i++) {
+				c = readchar();
+				frame.payload[i] = c;
+				crc = crc16_byte(crc, c);
+			}
+			/*
+			 * The data of a LOAD frame that continues the previous
+			 * one is written straight to its destination. This
+			 * needs a header CRC, as a corrupted address or length
+			 * would write over data that the host will not send
+			 * again (blocks skipped by delta uploads, memory past
+			 * the image). The frame then only writes to its own
+			 * destination, and if its CRC turns out to be bad,
+			 * the host sends it again and overwrites the data.
+			 */
+			if(check_header(head)) {
+				header = 1;
+				if((features & SFL_FEATURE_WINDOW)
+				  && runnable(frame.seq)
+				  && (frame.cmd == SFL_CMD_LOAD) && (frame.length > 4)
+				  && load_next_valid && (load_next == (
+					 ((unsigned int)frame.payload[0] << 24)
+					|((unsigned int)frame.payload[1] << 16)
+					|((unsigned int)frame.payload[2] << 8)
+					|((unsigned int)frame.payload[3] << 0))))
+					direct = (unsigned char *)load_next;
+				if(direct != NULL) {
+					for(;i<frame.length;i++) {
+						c = readchar();
+						direct[i-4] = c;
+						crc = crc16_byte(crc, c);
+					}
+				} else {
+					for(;i<frame.length;i++) {
+						c = readchar();
+						frame.payload[i] = c;
+						crc = crc16_byte(crc, c);
+					}
+				}
+				goodcrc = crc;
+			}
+		}
 		if(actualcrc != goodcrc) {
-			failed++;
-			if(failed == MAX_FAILED) {
-				printf("E: Too many consecutive errors, aborting");
-				return;
+			/* In windowed mode, the host recovers from any number
+			 * of damaged frames, as long as the line works at all.
+			 */
+			if(!(features & SFL_FEATURE_WINDOW)) {
+				failed++;
+				if(failed == MAX_FAILED) {
+					printf("E: Too many consecutive errors, aborting");
+					return;
+				}
+			}
+			/* With a good header, the framing is intact and only
+			 * this frame has to be sent again.
+			 */
+			if(header && (features & SFL_FEATURE_SELECTIVE)) {
+				reply(SFL_ACK_RESEND, frame.seq);
+				continue;
 			}
-			writechar(SFL_ACK_CRCERROR);
+			/* The rest of the window is lost as well (and the
+			 * length byte may have been corrupted), so tell the
+			 * host to stop sending at once, and wait for the line
+			 * to be quiet before asking it to retransmit.
+			 */
+			if(features & SFL_FEATURE_WINDOW) {
+				if(features & SFL_FEATURE_SELECTIVE)
+					reply(SFL_ACK_HOLD, next_seq);
+				drain_rx();
+			}
+			reply(SFL_ACK_CRCERROR, next_seq);
 			continue;
 		}
 		
 		/* CRC OK */
+		/* Without SFL_FEATURE_SELECTIVE, frames ahead of the
+		 * expected one were sent before the host got
+		 * SFL_ACK_CRCERROR and are sent again after it.
+		 */
+		if(!runnable(frame.seq))
+			continue;
+		ahead = frame.seq - next_seq;
+		if(ahead < 128) {
+			if((ahead > 0) && in_order(frame.cmd)) {
+				reply(SFL_ACK_RESEND, frame.seq);
+				continue;
+			}
+			done_mask |= 1 << ahead;
+			while(done_mask & 1) {
+				done_mask >>= 1;
+				next_seq++;
+			}
+		}
+		/* The fields beyond the payload would be left over from
+		 * earlier frames.
+		 */
+		if(frame.length < min_length(frame.cmd)) {
+			reply(SFL_ACK_ERROR, frame.seq);
+			continue;
+		}
 		switch(frame.cmd) {
 			case SFL_CMD_ABORT:
 				failed = 0;
-				writechar(SFL_ACK_SUCCESS);
+				reply(SFL_ACK_SUCCESS, frame.seq);
 				return;
 			case SFL_CMD_LOAD: {
+				unsigned int addr;
 				char *writepointer;
 				
 				failed = 0;
-				writepointer = (char *)(
+				addr =  ((unsigned int)frame.payload[0] << 24)
+					|((unsigned int)frame.payload[1] << 16)
+					|((unsigned int)frame.payload[2] << 8)
+					|((unsigned int)frame.payload[3] << 0);
+				writepointer = (char *)addr;
+				if(direct == NULL) {
+					for(i=4;i<frame.length;i++)
+						writepointer[i-4] = frame.payload[i];
+				}
+				reply(SFL_ACK_SUCCESS, frame.seq);
+				load_next = addr + frame.length - 4;
+				load_next_valid = 1;
+				break;
+			}
+			case SFL_CMD_LOAD_COMPRESSED: {
+				unsigned char *writepointer;
+				int length;
+				
+				failed = 0;
+				writepointer = (unsigned char *)(
 					 ((unsigned int)frame.payload[0] << 24)
 					|((unsigned int)frame.payload[1] << 16)
 					|((unsigned int)frame.payload[2] << 8)
 					|((unsigned int)frame.payload[3] << 0));
-				for(i=4;i<frame.length;i++)
-					*(writepointer++) = frame.payload[i];
-				writechar(SFL_ACK_SUCCESS);
+				length =  ((unsigned int)frame.payload[4] << 24)
+					 |((unsigned int)frame.payload[5] << 16)
+					 |((unsigned int)frame.payload[6] << 8)
+					 |((unsigned int)frame.payload[7] << 0);
+				if(lz4_decompress(&frame.payload[8], frame.length-8, writepointer, length) != length)
+					reply(SFL_ACK_ERROR, frame.seq);
+				else
+					reply(SFL_ACK_SUCCESS, frame.seq);
+				break;
+			}
+			case SFL_CMD_CRC32: {
+				unsigned int addr;
+				unsigned int length;
+				unsigned int crc;
+				unsigned char result[4];
+				
+				failed = 0;
+				addr =  ((unsigned int)frame.payload[0] << 24)
+					|((unsigned int)frame.payload[1] << 16)
+					|((unsigned int)frame.payload[2] << 8)
+					|((unsigned int)frame.payload[3] << 0);
+				length =  ((unsigned int)frame.payload[4] << 24)
+					 |((unsigned int)frame.payload[5] << 16)
+					 |((unsigned int)frame.payload[6] << 8)
+					 |((unsigned int)frame.payload[7] << 0);
+				crc = crc32((unsigned char *)addr, length);
+				result[0] = (crc & 0xff000000) >> 24;
+				result[1] = (crc & 0x00ff0000) >> 16;
+				result[2] = (crc & 0x0000ff00) >> 8;
+				result[3] = (crc & 0x000000ff);
+				reply_data(frame.seq, result, 4);
+				break;
+			}
+			case SFL_CMD_FILL: {
+				unsigned int addr;
+				unsigned int length;
+				
+				failed = 0;
+				addr =  ((unsigned int)frame.payload[0] << 24)
+					|((unsigned int)frame.payload[1] << 16)
+					|((unsigned int)frame.payload[2] << 8)
+					|((unsigned int)frame.payload[3] << 0);
+				length =  ((unsigned int)frame.payload[4] << 24)
+					 |((unsigned int)frame.payload[5] << 16)
+					 |((unsigned int)frame.payload[6] << 8)
+					 |((unsigned int)frame.payload[7] << 0);
+				fill((unsigned char *)addr, length, frame.payload[8]);
+				reply(SFL_ACK_SUCCESS, frame.seq);
+				break;
+			}
+			case SFL_CMD_BAUD: {
+				unsigned int baudrate;
+				unsigned int divisor;
+				unsigned int actual;
+				unsigned int olddivisor;
+				unsigned char result[4];
+				
+				failed = 0;
+				baudrate =  ((unsigned int)frame.payload[0] << 24)
+					   |((unsigned int)frame.payload[1] << 16)
+					   |((unsigned int)frame.payload[2] << 8)
+					   |((unsigned int)frame.payload[3] << 0);
+				actual = 0;
+				if(baudrate > 0) {
+					divisor = (brd_desc->clk_frequency + 8*baudrate)/(16*baudrate);
+					if((divisor > 0) && (divisor <= 0xffff))
+						actual = brd_desc->clk_frequency/(16*divisor);
+					/* Stay within 3% of the requested rate */
+					if((actual > baudrate + baudrate/32)
+					  || (actual < baudrate - baudrate/32))
+						actual = 0;
+				}
+				result[0] = (actual & 0xff000000) >> 24;
+				result[1] = (actual & 0x00ff0000) >> 16;
+				result[2] = (actual & 0x0000ff00) >> 8;
+				result[3] = (actual & 0x000000ff);
+				reply_data(frame.seq, result, 4);
+				if(actual != 0) {
+					/* Wait until the reply has been sent entirely */
+					uart_force_sync(1);
+					olddivisor = CSR_UART_DIVISOR;
+					CSR_UART_DIVISOR = divisor;
+					if(check_baud_confirm()) {
+						for(i=0;i<SFL_BAUD_CONFIRM_LEN;i++)
+							writechar(SFL_BAUD_CONFIRM[i]);
+					} else
+						CSR_UART_DIVISOR = olddivisor;
+					uart_force_sync(0);
+				}
 				break;
 			}
 			case SFL_CMD_JUMP: {
@@ -146,7 +577,11 @@ void serialboot()
 					|((unsigned int)frame.payload[1] << 16)
 					|((unsigned int)frame.payload[2] << 8)
 					|((unsigned int)frame.payload[3] << 0);
-				writechar(SFL_ACK_SUCCESS);
+				reply(SFL_ACK_SUCCESS, frame.seq);
+				/* Flush the UART and leave interrupts off for the program */
+				uart_force_sync(1);
+				irq_setmask(0);
+				irq_enable(0);
 				boot(cmdline_adr, initrdstart_adr, initrdend_adr, addr);
 				break;
 			}
@@ -156,7 +591,7 @@ void serialboot()
 					      |((unsigned int)frame.payload[1] << 16)
 					      |((unsigned int)frame.payload[2] << 8)
 					      |((unsigned int)frame.payload[3] << 0);
-				writechar(SFL_ACK_SUCCESS);
+				reply(SFL_ACK_SUCCESS, frame.seq);
 				break;
 			case SFL_CMD_INITRDSTART:
 				failed = 0;
@@ -164,7 +599,7 @@ void serialboot()
 					          |((unsigned int)frame.payload[1] << 16)
 					          |((unsigned int)frame.payload[2] << 8)
 					          |((unsigned int)frame.payload[3] << 0);
-				writechar(SFL_ACK_SUCCESS);
+				reply(SFL_ACK_SUCCESS, frame.seq);
 				break;
 			case SFL_CMD_INITRDEND:
 				failed = 0;
@@ -172,15 +607,38 @@ void serialboot()
 					        |((unsigned int)frame.payload[1] << 16)
 					        |((unsigned int)frame.payload[2] << 8)
 					        |((unsigned int)frame.payload[3] << 0);
-				writechar(SFL_ACK_SUCCESS);
+				reply(SFL_ACK_SUCCESS, frame.seq);
 				break;
+			case SFL_CMD_HELLO: {
+				int requested;
+				int window;
+
+				failed = 0;
+				requested = frame.length > 0 ? frame.payload[0] : 0;
+				window = frame.length > 1 ? frame.payload[1] : 1;
+				if(window > SFL_WINDOW_MAX)
+					window = SFL_WINDOW_MAX;
+				if(window < 1)
+					window = 1;
+				/* Reply in the current mode, then switch */
+				reply(SFL_ACK_SUCCESS, frame.seq);
+				requested &= SUPPORTED_FEATURES;
+				if(!(requested & SFL_FEATURE_WINDOW))
+					requested &= ~SFL_FEATURE_LARGE;
+				writechar(requested);
+				writechar(window);
+				features = requested;
+				next_seq = 0;
+				done_mask = 0;
+				break;
+			}
 			default:
 				failed++;
 				if(failed == MAX_FAILED) {
 					printf("E: Too many consecutive errors, aborting");
 					return;
 				}
-				writechar(SFL_ACK_UNKNOWN);
+				reply(SFL_ACK_UNKNOWN, frame.seq);
 				break;
 		}
 	}
@@ -21,4 +21,10 @@
 void cardboot(int alt);
 void serialboot();
 
+/*
+ * The serial boot frame buffer, the largest one in the BIOS SRAM, for
+ * shell commands that need a work area. Returns its size in size.
+ */
+void *boot_scratch(unsigned int *size);
+
 #endif /* __BOOT_H */
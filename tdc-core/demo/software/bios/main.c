@@ -19,7 +19,15 @@
 #include <console.h>
 #include <string.h>
 #include <uart.h>
+#include <irq.h>
 #include <crc.h>
+#include <timer.h>
+#ifdef BIOS_BENCH
+#include <profile.h>
+#include <pcprof.h>
+#include <divide.h>
+#endif
+#include <sfl.h>
 #include <system.h>
 #include <board.h>
 #include <version.h>
@@ -172,6 +180,10 @@ static void crc(char *startaddr, char *len)
 	char *c;
 	char *addr;
 	unsigned int length;
+	unsigned int value;
+#ifdef BIOS_BENCH
+	unsigned int cycles;
+#endif
 
 	if((*startaddr == 0)||(*len == 0)) {
 		printf("crc <address> <length>\n");
@@ -188,9 +200,463 @@ static void crc(char *startaddr, char *len)
 		return;
 	}
 
-	printf("CRC32: %08x\n", crc32((unsigned char *)addr, length));
+#ifdef BIOS_BENCH
+	cycles = timer_cycles();
+	value = crc32((unsigned char *)addr, length);
+	cycles = timer_cycles() - cycles;
+	printf("CRC32: %08x\n", value);
+	if(timer_present() && (length >= 1024))
+		printf("%u cycles, %u cycles/KB\n", cycles, cycles/(length/1024));
+#else
+	value = crc32((unsigned char *)addr, length);
+	printf("CRC32: %08x\n", value);
+#endif
 }
 
+static unsigned short write_crc16(unsigned short crc, const unsigned char *data, unsigned int length)
+{
+	while(length-- > 0) {
+		writechar(*data);
+		crc = crc16_byte(crc, *data++);
+	}
+	return crc;
+}
+
+/* Binary memory dump for host tools (flterm --dump), see sfl.h */
+static void mrb(char *startaddr, char *len)
+{
+	char *c;
+	unsigned int addr;
+	unsigned int length;
+	unsigned int chunk;
+	unsigned int crc;
+	unsigned short crc16;
+	unsigned char header[7];
+
+	if((*startaddr == 0)||(*len == 0)) {
+		printf("mrb <address> <length>\n");
+		return;
+	}
+	addr = strtoul(startaddr, &c, 0);
+	if(*c != 0) {
+		printf("incorrect address\n");
+		return;
+	}
+	length = strtoul(len, &c, 0);
+	if(*c != 0) {
+		printf("incorrect length\n");
+		return;
+	}
+
+	putsnonl(SFL_DUMP_MAGIC);
+	crc = crc32((unsigned char *)addr, length);
+	while(length > 0) {
+		chunk = length > SFL_DUMP_CHUNK ? SFL_DUMP_CHUNK : length;
+		header[0] = SFL_DUMP_DATA;
+		header[1] = (addr & 0xff000000) >> 24;
+		header[2] = (addr & 0x00ff0000) >> 16;
+		header[3] = (addr & 0x0000ff00) >> 8;
+		header[4] = (addr & 0x000000ff);
+		header[5] = (chunk & 0xff00) >> 8;
+		header[6] = (chunk & 0x00ff);
+		writechar(header[0]);
+		crc16 = write_crc16(0, &header[1], 6);
+		crc16 = write_crc16(crc16, (unsigned char *)addr, chunk);
+		writechar((crc16 & 0xff00) >> 8);
+		writechar(crc16 & 0x00ff);
+		addr += chunk;
+		length -= chunk;
+	}
+	writechar(SFL_DUMP_END);
+	writechar((crc & 0xff000000) >> 24);
+	writechar((crc & 0x00ff0000) >> 16);
+	writechar((crc & 0x0000ff00) >> 8);
+	writechar(crc & 0x000000ff);
+	putsnonl("\n");
+}
+
+/* Time without data after which batch mode gives up on the host, and
+ * after which a packet is considered cut short or the rest of a damaged
+ * packet gone, in milliseconds.
+ */
+#define BATCH_TIMEOUT 1000
+#define BATCH_DRAIN_IDLE 100
+
+static int readchar_timeout(unsigned char *c, unsigned int ms)
+{
+	struct timer_window w;
+
+	/* Data is usually there already, do not start a window for it */
+	if(!readchar_nonblock()) {
+		timer_window_start(&w, ms);
+		while(!readchar_nonblock())
+			if(timer_window_expired(&w))
+				return 0;
+	}
+	*c = readchar();
+	return 1;
+}
+
+/* Waits for the rest of a damaged packet to go by */
+static void discard_input()
+{
+	unsigned char c;
+
+	while(readchar_timeout(&c, BATCH_DRAIN_IDLE));
+}
+
+static unsigned int get_word(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24)
+		|((unsigned int)p[1] << 16)
+		|((unsigned int)p[2] << 8)
+		|((unsigned int)p[3] << 0);
+}
+
+/* Runs an operation list, or only checks it if execute is 0.
+ * Returns the length of the result, or -1 if the list is invalid.
+ */
+static int run_batch(const unsigned char *ops, int length, unsigned char *result, int execute)
+{
+	unsigned int *src, *dst;
+	unsigned int value;
+	unsigned int count;
+	int position;
+	int rlength;
+
+	position = 0;
+	rlength = 0;
+	while(position < length) {
+		switch(ops[position]) {
+			case SFL_BATCH_WRITE:
+				if(length - position < 9) return -1;
+				if(execute)
+					*(unsigned int *)get_word(&ops[position+1]) = get_word(&ops[position+5]);
+				position += 9;
+				break;
+			case SFL_BATCH_READ:
+				if(length - position < 5) return -1;
+				if(execute) {
+					value = *(unsigned int *)get_word(&ops[position+1]);
+					result[rlength] = (value & 0xff000000) >> 24;
+					result[rlength+1] = (value & 0x00ff0000) >> 16;
+					result[rlength+2] = (value & 0x0000ff00) >> 8;
+					result[rlength+3] = (value & 0x000000ff);
+				}
+				rlength += 4;
+				position += 5;
+				break;
+			case SFL_BATCH_COPY:
+				if(length - position < 13) return -1;
+				if(execute) {
+					dst = (unsigned int *)get_word(&ops[position+1]);
+					src = (unsigned int *)get_word(&ops[position+5]);
+					count = get_word(&ops[position+9]);
+					while(count-- > 0)
+						*dst++ = *src++;
+				}
+				position += 13;
+				break;
+			default:
+				return -1;
+		}
+	}
+	return rlength;
+}
+
+/* Binary batches of memory operations for host tools (flterm --batch), see sfl.h */
+static void batch()
+{
+	unsigned char *ops, *result;
+	unsigned int size;
+	unsigned char header[4];
+	unsigned int length;
+	unsigned short crc;
+	int rlength;
+	int i;
+
+	/* Both go to the serial boot frame buffer */
+	ops = boot_scratch(&size);
+	if(size < 2*SFL_BATCH_MAX) {
+		printf("Batch buffer too small\n");
+		return;
+	}
+	result = ops + SFL_BATCH_MAX;
+
+	/* Length of the result of the last list, -1 if it was not run */
+	rlength = -1;
+	putsnonl(SFL_BATCH_MAGIC);
+	while(1) {
+		/* The host has gone away if no packet comes */
+		if(!readchar_timeout(&header[0], BATCH_TIMEOUT))
+			return;
+		for(i=1;i<4;i++)
+			if(!readchar_timeout(&header[i], BATCH_DRAIN_IDLE)) break;
+		length = ((unsigned int)header[0] << 8)|header[1];
+		crc = ((unsigned int)header[2] << 8)|header[3];
+		if((i == 4) && (length == SFL_BATCH_REPEAT) && (crc == SFL_BATCH_REPEAT)) {
+			if(rlength < 0) {
+				writechar(SFL_ACK_CRCERROR);
+				continue;
+			}
+			length = 1; /* do not leave the batch mode */
+		} else {
+			rlength = -1;
+			if((i < 4) || (length > SFL_BATCH_MAX)) {
+				discard_input();
+				writechar(SFL_ACK_CRCERROR);
+				continue;
+			}
+			crc = 0;
+			for(i=0;i<length;i++) {
+				if(!readchar_timeout(&ops[i], BATCH_DRAIN_IDLE)) break;
+				crc = crc16_byte(crc, ops[i]);
+			}
+			if((i < length) || (crc != (((unsigned int)header[2] << 8)|header[3]))) {
+				discard_input();
+				writechar(SFL_ACK_CRCERROR);
+				continue;
+			}
+			if(run_batch(ops, length, result, 0) < 0) {
+				writechar(SFL_ACK_ERROR);
+				continue;
+			}
+			rlength = run_batch(ops, length, result, 1);
+		}
+		crc = crc16(result, rlength);
+		writechar(SFL_ACK_DATA);
+		writechar((rlength & 0xff00) >> 8);
+		writechar(rlength & 0x00ff);
+		writechar((crc & 0xff00) >> 8);
+		writechar(crc & 0x00ff);
+		for(i=0;i<rlength;i++)
+			writechar(result[i]);
+		if(length == 0)
+			return;
+	}
+}
+
+#ifdef BIOS_BENCH
+/*
+ * Benchmark of the memory functions of libbase, in cycles per KB, in the
+ * serial boot frame buffer, which is idle at the prompt. The "bytes" column
+ * is a plain byte loop, for comparison.
+ */
+#define MEMBENCH_SIZE 1024
+#define MEMBENCH_BYTES 16384 /* moved by each measurement */
+
+static void __attribute__((noinline)) byte_copy(char *dst, const char *src, int n)
+{
+	while(n-- > 0)
+		*dst++ = *src++;
+}
+
+static void membench()
+{
+	static const int sizes[] = { 16, 64, 256, MEMBENCH_SIZE };
+	static const int offsets[][2] = { { 0, 0 }, { 1, 1 }, { 0, 1 }, { 2, 0 } };
+	unsigned int t[5];
+	char *buffer, *src, *dst, *d, *s;
+	unsigned int buffer_size;
+	int size, reps;
+	int i, j, k, r;
+
+	if(!timer_present()) {
+		printf("No timer\n");
+		return;
+	}
+	/* Alignment, then source and destination with room for the offsets */
+	buffer = boot_scratch(&buffer_size);
+	if(buffer_size < 31 + (MEMBENCH_SIZE + 32) + (MEMBENCH_SIZE + 64)) {
+		printf("Benchmark buffer too small\n");
+		return;
+	}
+	src = (char *)(((unsigned int)buffer + 31) & ~31);
+	dst = src + MEMBENCH_SIZE + 32;
+	for(k=0;k<MEMBENCH_SIZE+32;k++)
+		src[k] = k;
+
+	puts(" size dst/src  bytes memcpy memmove memset memcmp");
+	for(i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++) {
+		size = sizes[i];
+		reps = MEMBENCH_BYTES/size;
+		for(j=0;j<sizeof(offsets)/sizeof(offsets[0]);j++) {
+			d = dst + offsets[j][0];
+			s = src + offsets[j][1];
+
+			t[0] = timer_cycles();
+			for(r=0;r<reps;r++)
+				byte_copy(d, s, size);
+			t[0] = timer_cycles() - t[0];
+
+			/* Overlapping, towards higher addresses */
+			t[2] = timer_cycles();
+			for(r=0;r<reps;r++)
+				memmove(d + 8, dst + offsets[j][1], size);
+			t[2] = timer_cycles() - t[2];
+
+			t[3] = timer_cycles();
+			for(r=0;r<reps;r++)
+				memset(d, 0x5a, size);
+			t[3] = timer_cycles() - t[3];
+
+			t[1] = timer_cycles();
+			for(r=0;r<reps;r++)
+				memcpy(d, s, size);
+			t[1] = timer_cycles() - t[1];
+			for(k=0;k<size;k++)
+				if(d[k] != s[k]) {
+					printf("memcpy error at %d/%d, size %d\n", offsets[j][0], offsets[j][1], size);
+					return;
+				}
+
+			/* Equal areas: full length */
+			t[4] = timer_cycles();
+			for(r=0;r<reps;r++)
+				memcmp(d, s, size);
+			t[4] = timer_cycles() - t[4];
+
+			printf("%5d   %d/%d  %6u %6u %6u  %6u %6u\n", size, offsets[j][0], offsets[j][1],
+				t[0]/(MEMBENCH_BYTES/1024), t[1]/(MEMBENCH_BYTES/1024),
+				t[2]/(MEMBENCH_BYTES/1024), t[3]/(MEMBENCH_BYTES/1024),
+				t[4]/(MEMBENCH_BYTES/1024));
+		}
+	}
+}
+
+#define DIVBENCH_REPS 256
+
+/* The shift-subtract loop libbase used before divide.c */
+static unsigned int __attribute__((noinline)) shift_subtract_div(unsigned int num, unsigned int den)
+{
+	unsigned int bit = 1;
+	unsigned int res = 0;
+
+	while((den < num) && bit && !(den & 0x80000000)) {
+		den <<= 1;
+		bit <<= 1;
+	}
+	while(bit) {
+		if(num >= den) {
+			num -= den;
+			res |= bit;
+		}
+		bit >>= 1;
+		den >>= 1;
+	}
+	return res;
+}
+
+/* Results go there so that the divisions are not optimised out */
+static volatile unsigned int sink;
+
+static void divbench()
+{
+	static const unsigned int cases[][2] = {
+		{ 1000, 7 },			/* small quotient */
+		{ 123456789, 10 },		/* decimal printing */
+		{ 0xfffffff0, 125 },		/* cycles to microseconds */
+		{ 0xdeadbeef, 3 },		/* full width quotient */
+		{ 0xdeadbeef, 0x12345 },	/* 15-bit quotient */
+		{ 123456789, 4096 }		/* power of 2 */
+	};
+	/* Keep the compiler from seeing the operands */
+	volatile unsigned int vnum, vden;
+	struct udiv_const d;
+	unsigned int den;
+	unsigned int t[4];
+	int i, r;
+
+	if(!timer_present()) {
+		printf("No timer\n");
+		return;
+	}
+	puts("  dividend    divisor  loop   old   new const (cycles/divide)");
+	for(i=0;i<sizeof(cases)/sizeof(cases[0]);i++) {
+		vnum = cases[i][0];
+		vden = cases[i][1];
+		den = vden;
+		udiv_const_init(&d, den);
+		if((shift_subtract_div(vnum, den) != vnum/den)
+		  || (udiv_const(&d, vnum, NULL) != vnum/den)) {
+			printf("Division error on %u/%u\n", cases[i][0], cases[i][1]);
+			return;
+		}
+
+		t[0] = timer_cycles();
+		for(r=0;r<DIVBENCH_REPS;r++)
+			sink = vnum;
+		t[0] = timer_cycles() - t[0];
+
+		t[1] = timer_cycles();
+		for(r=0;r<DIVBENCH_REPS;r++)
+			sink = shift_subtract_div(vnum, den);
+		t[1] = timer_cycles() - t[1];
+
+		t[2] = timer_cycles();
+		for(r=0;r<DIVBENCH_REPS;r++)
+			sink = vnum/den;
+		t[2] = timer_cycles() - t[2];
+
+		t[3] = timer_cycles();
+		for(r=0;r<DIVBENCH_REPS;r++)
+			sink = udiv_const(&d, vnum, NULL);
+		t[3] = timer_cycles() - t[3];
+
+		/* Loop cost on its own, then without it */
+		printf("%10u %10u %5u %5u %5u %5u\n", cases[i][0], cases[i][1],
+			t[0]/DIVBENCH_REPS, (t[1] - t[0])/DIVBENCH_REPS,
+			(t[2] - t[0])/DIVBENCH_REPS, (t[3] - t[0])/DIVBENCH_REPS);
+	}
+}
+
+#define LLBENCH_REPS 64
+
+static volatile unsigned long long llsink;
+
+/* Cycles per operation, without those of the loop */
+#define LLBENCH(name, op) \
+	do { \
+		t = timer_cycles(); \
+		for(r=0;r<LLBENCH_REPS;r++) \
+			op; \
+		t = timer_cycles() - t; \
+		printf("%-9s %7u\n", name, (t - loop)/LLBENCH_REPS); \
+	} while(0)
+
+static void llbench()
+{
+	volatile unsigned long long va, vb;
+	volatile int vn;
+	unsigned int t, loop;
+	char buffer[24];
+	int r;
+
+	if(!timer_present()) {
+		printf("No timer\n");
+		return;
+	}
+	/* A 38-bit timestamp and a wide divisor */
+	va = 0x2a5c3e1f0bULL;
+	vb = 0x1234567890ULL;
+	vn = 13;
+
+	loop = timer_cycles();
+	for(r=0;r<LLBENCH_REPS;r++)
+		llsink = va;
+	loop = timer_cycles() - loop;
+
+	puts("operation  cycles");
+	LLBENCH("a-b", llsink = va - vb);
+	LLBENCH("a*7812", llsink = va*7812);
+	LLBENCH("a*b", llsink = va*vb);
+	LLBENCH("a/125", llsink = va/125);
+	LLBENCH("a/b", llsink = va/vb);
+	LLBENCH("a>>n", llsink = va >> vn);
+	LLBENCH("%llu", snprintf(buffer, sizeof(buffer), "%llu", va));
+}
+#endif /* BIOS_BENCH */
+
 /* Init + command line */
 
 static void help()
@@ -201,6 +667,15 @@ static void help()
 	puts("mw         - write address space");
 	puts("mc         - copy address space");
 	puts("crc        - compute CRC32 of a part of the address space");
+	puts("mrb        - binary memory dump, for flterm --dump");
+	puts("batch      - binary memory operation lists, for flterm --batch");
+#ifdef BIOS_BENCH
+	puts("membench   - benchmark the memory functions");
+	puts("divbench   - benchmark the division routines");
+	puts("llbench    - benchmark the 64-bit arithmetic helpers");
+	puts("prof       - print the profiled regions, 'prof clear' resets them");
+	puts("pcprof     - sample the BIOS code: pcprof start [Hz], pcprof stop, pcprof");
+#endif
 	puts("serialboot - attempt SFL boot");
 	puts("reboot     - system reset");
 }
@@ -221,16 +696,76 @@ static char *get_token(char **str)
 	return d;
 }
 
+#ifdef BIOS_BENCH
+static void prof(char *arg)
+{
+	if(strcmp(arg, "clear") == 0)
+		profile_clear();
+	else if(*arg == 0)
+		profile_dump();
+	else
+		printf("prof [clear]\n");
+}
+
+#define PCPROF_RATE 1000 /* default samples per second */
+
+extern unsigned int _ftext, _etext;
+
+static void pcprof(char *action, char *rate)
+{
+	char *c;
+	unsigned int hz;
+
+	if(strcmp(action, "start") == 0) {
+		if(brd_desc == NULL) {
+			printf("Unknown clock frequency\n");
+			return;
+		}
+		hz = PCPROF_RATE;
+		if(*rate != 0) {
+			hz = strtoul(rate, &c, 0);
+			if((*c != 0) || (hz == 0) || (hz > 100000)) {
+				printf("incorrect rate\n");
+				return;
+			}
+		}
+		/* An odd period keeps clear of lockstep with even-length loops */
+		pcprof_start((unsigned int)&_ftext,
+			(unsigned int)&_etext - (unsigned int)&_ftext,
+			(brd_desc->clk_frequency/hz) | 1);
+	} else if(strcmp(action, "stop") == 0)
+		pcprof_stop();
+	else if(*action == 0)
+		pcprof_dump();
+	else
+		printf("pcprof [start [Hz]|stop]\n");
+}
+
+static struct profile_region command_region = PROFILE_REGION("command");
+#endif
+
 static void do_command(char *c)
 {
 	char *token;
 
+#ifdef BIOS_BENCH
+	profile_start(&command_region);
+#endif
 	token = get_token(&c);
 
 	if(strcmp(token, "mr") == 0) mr(get_token(&c), get_token(&c));
 	else if(strcmp(token, "mw") == 0) mw(get_token(&c), get_token(&c), get_token(&c));
 	else if(strcmp(token, "mc") == 0) mc(get_token(&c), get_token(&c), get_token(&c));
 	else if(strcmp(token, "crc") == 0) crc(get_token(&c), get_token(&c));
+	else if(strcmp(token, "mrb") == 0) mrb(get_token(&c), get_token(&c));
+	else if(strcmp(token, "batch") == 0) batch();
+#ifdef BIOS_BENCH
+	else if(strcmp(token, "membench") == 0) membench();
+	else if(strcmp(token, "divbench") == 0) divbench();
+	else if(strcmp(token, "llbench") == 0) llbench();
+	else if(strcmp(token, "prof") == 0) prof(get_token(&c));
+	else if(strcmp(token, "pcprof") == 0) pcprof(get_token(&c), get_token(&c));
+#endif
 	
 	else if(strcmp(token, "serialboot") == 0) serialboot();
 
@@ -240,15 +775,29 @@ static void do_command(char *c)
 	
 	else if(strcmp(token, "") != 0)
 		printf("Command not found\n");
+#ifdef BIOS_BENCH
+	profile_stop(&command_region);
+#endif
 }
 
-static int test_user_abort()
+/*
+ * Time to press Q, in milliseconds. Fast boot, selected at build time
+ * with FASTBOOT or with the fast boot GPIO inputs of the board, skips
+ * this window; a Q typed before is still honored.
+ */
+#ifndef ABORT_WINDOW
+#define ABORT_WINDOW 1000
+#endif
+
+static int test_user_abort(unsigned int window)
 {
-	unsigned int i;
+	struct timer_window w;
 	char c;
 	
-	puts("I: Press Q to abort boot");
-	for(i=0;i<4000000;i++) {
+	if(window > 0)
+		puts("I: Press Q to abort boot");
+	timer_window_start(&w, window);
+	do {
 		if(readchar_nonblock()) {
 			c = readchar();
 			if(c == 'Q') {
@@ -256,10 +805,51 @@ static int test_user_abort()
 				return 0;
 			}
 		}
-	}
+	} while(!timer_window_expired(&w));
 	return 1;
 }
 
+static int fastboot()
+{
+#ifdef FASTBOOT
+	return 1;
+#else
+	return (CSR_GPIO_IN & brd_desc->fastboot_gpio) != 0;
+#endif
+}
+
+/* Boot phase timing, in cycles since timer_init() */
+#define BOOT_PHASES 8
+
+static const char *phase_name[BOOT_PHASES];
+static unsigned int phase_end[BOOT_PHASES];
+static int phases;
+
+static void boot_phase(const char *name)
+{
+	if(phases < BOOT_PHASES) {
+		phase_name[phases] = name;
+		phase_end[phases] = timer_cycles();
+		phases++;
+	}
+}
+
+static void print_boot_phases()
+{
+	unsigned int start;
+	int i;
+
+	if(!timer_present())
+		return;
+	printf("I: Boot phases (cycles):");
+	start = 0;
+	for(i=0;i<phases;i++) {
+		printf(" %s %u", phase_name[i], phase_end[i] - start);
+		start = phase_end[i];
+	}
+	printf(", total %u\n", start);
+}
+
 extern unsigned int _edata;
 
 static void crcbios()
@@ -303,7 +893,16 @@ static const char banner[] =
 
 static void boot_sequence()
 {
-	if(test_user_abort()) {
+	int abort;
+
+	if(fastboot()) {
+		puts("I: Fast boot");
+		abort = !test_user_abort(0);
+	} else
+		abort = !test_user_abort(ABORT_WINDOW);
+	boot_phase("abort");
+	print_boot_phases();
+	if(!abort) {
 		serialboot(1);
 		printf("E: No boot medium found\n");
 	}
@@ -313,13 +912,24 @@ int main(int i, char **c)
 {
 	char buffer[64];
 
+	irq_setmask(0);
+	irq_enable(1);
+	uart_async_init();
+
 	brd_desc = get_board_desc();
+	timer_init(brd_desc != NULL ? brd_desc->clk_frequency : 0);
+#ifdef BIOS_BENCH
+	profile_init();
+#endif
 
 	/* Display a banner as soon as possible to show that the system is alive */
 	putsnonl(banner);
+	boot_phase("banner");
 
 	crcbios();
+	boot_phase("crc");
 	display_board();
+	boot_phase("board");
 
 	boot_sequence();
 
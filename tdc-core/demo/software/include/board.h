@@ -24,6 +24,7 @@ struct board_desc {
 	unsigned int id;
 	char name[BOARD_NAME_LEN];
 	unsigned int clk_frequency;
+	unsigned int fastboot_gpio;	/* GPIO inputs that select fast boot */
 };
 
 const struct board_desc *get_board_desc_id(unsigned int id);
@@ -18,7 +18,18 @@
 #ifndef __CRC_H
 #define __CRC_H
 
+extern const unsigned int crc16_table[256];
+
 unsigned short crc16(const unsigned char *buffer, int len);
+
+/* Adds one byte to a running CRC16, to check data as it arrives */
+static inline unsigned short crc16_byte(unsigned short crc, unsigned char c)
+{
+	return crc16_table[((crc >> 8) ^ c) & 0xff] ^ (crc << 8);
+}
+
 unsigned int crc32(const unsigned char *buffer, unsigned int len);
+/* Continues a CRC32, starting from 0 for new data */
+unsigned int crc32_update(unsigned int crc, const unsigned char *buffer, unsigned int len);
 
 #endif
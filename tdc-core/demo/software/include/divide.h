@@ -0,0 +1,45 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2010 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DIVIDE_H
+#define __DIVIDE_H
+
+/*
+ * Unsigned division without hardware divider. These functions return
+ * the quotient and store the remainder unless rem is NULL.
+ * The divisor must not be 0. udivmod64() is fastest when the divisor
+ * fits in 32 bits.
+ *
+ * For repeated divisions by the same divisor, udiv_const_init()
+ * prepares it once: powers of 2 become shifts, other divisors are
+ * normalised so that each division only produces the quotient bits.
+ */
+
+unsigned int udivmod(unsigned int num, unsigned int den, unsigned int *rem);
+unsigned long long udivmod64(unsigned long long num, unsigned long long den,
+	unsigned long long *rem);
+
+struct udiv_const {
+	unsigned int divisor;
+	unsigned int normalized;
+	int shift;
+};
+
+void udiv_const_init(struct udiv_const *d, unsigned int divisor);
+unsigned int udiv_const(const struct udiv_const *d, unsigned int num, unsigned int *rem);
+
+#endif /* __DIVIDE_H */
@@ -35,6 +35,10 @@
 #define TIMER_ENABLE		(0x01)
 #define TIMER_AUTORESTART	(0x02)
 
+/* A write to CYCLES_LO snapshots the 64-bit counter for both reads */
+#define CSR_CYCLES_LO		MMPTR(0x80001030)
+#define CSR_CYCLES_HI		MMPTR(0x80001034)
+
 #define CSR_SYSTEM_ID		MMPTR(0x8000103c)
 
 #endif /* __HW_SYSCTL_H */
@@ -22,5 +22,10 @@
 
 #define CSR_UART_RXTX 		MMPTR(0x80000000)
 #define CSR_UART_DIVISOR	MMPTR(0x80000004)
+#define CSR_UART_RXLEVEL	MMPTR(0x80000008)
+#define CSR_UART_TXLEVEL	MMPTR(0x8000000C)
+#define CSR_UART_RXTHRESHOLD	MMPTR(0x80000010)
+#define CSR_UART_TXTHRESHOLD	MMPTR(0x80000014)
+#define CSR_UART_FIFODEPTH	MMPTR(0x80000018)
 
 #endif /* __HW_UART_H */
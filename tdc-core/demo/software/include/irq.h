@@ -25,4 +25,18 @@ unsigned int irq_getmask();
 unsigned int irq_pending();
 void irq_ack(unsigned int mask);
 
+/*
+ * Interrupt dispatch. Handlers must acknowledge their own interrupt.
+ * Lower priority values are served first.
+ * irq_attach() returns 0 unless irq is a single IRQ_* line.
+ * The fast handler serves IRQ_TDC straight from the interrupt entry,
+ * before the dispatcher and with a smaller register frame.
+ */
+typedef void (*irq_handler)(void);
+
+int irq_attach(unsigned int irq, irq_handler handler, int priority);
+void irq_detach(unsigned int irq);
+void irq_attach_fast(irq_handler handler);
+void isr();
+
 #endif /* __IRQ_H */
@@ -0,0 +1,40 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2010 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PCPROF_H
+#define __PCPROF_H
+
+/*
+ * Sampling profiler on TIMER1.
+ * Every period cycles, the interrupted PC is counted in a histogram of
+ * the code between base and base+size, in buckets of 2^shift bytes
+ * with shift as small as PCPROF_BUCKETS allows. Code running with
+ * interrupts disabled, ISRs included, is never sampled.
+ * pcprof_dump() prints the histogram for tools/pcprof.
+ * The histogram takes 2*PCPROF_BUCKETS bytes of SRAM for good; with 256
+ * buckets, a BIOS of 16 to 32KB is binned in 128-byte buckets.
+ */
+
+#ifndef PCPROF_BUCKETS
+#define PCPROF_BUCKETS 256
+#endif
+
+void pcprof_start(unsigned int base, unsigned int size, unsigned int period);
+void pcprof_stop();
+void pcprof_dump();
+
+#endif /* __PCPROF_H */
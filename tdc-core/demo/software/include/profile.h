@@ -0,0 +1,55 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2010 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+/*
+ * Profiling on the 64-bit cycle counter of the system controller.
+ * A region is defined once with
+ *	static struct profile_region r = PROFILE_REGION("name");
+ * and timed between profile_start(&r) and profile_stop(&r), which may
+ * nest with other regions but not with themselves. Regions are listed
+ * by profile_dump() once they have been stopped.
+ * The cost of a start/stop pair is measured by profile_init() and
+ * left out of the results.
+ */
+
+struct profile_region {
+	const char *name;
+	struct profile_region *next;
+	int listed;
+	unsigned int count;
+	unsigned int min;
+	unsigned int max;
+	unsigned long long total;
+	unsigned long long start;
+};
+
+#define PROFILE_REGION(name) { name }
+
+void profile_init();
+int profile_present();
+unsigned long long profile_cycles();
+
+void profile_start(struct profile_region *r);
+void profile_stop(struct profile_region *r);
+
+void profile_clear();
+void profile_dump();
+
+#endif /* __PROFILE_H */
@@ -0,0 +1,39 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2010 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TIMER_H
+#define __TIMER_H
+
+/*
+ * Time base on TIMER0, free-running at the system clock frequency.
+ * When the system controller has been left out at synthesis, windows
+ * are approximated by counting polls instead and timer_cycles() reads 0.
+ */
+
+struct timer_window {
+	unsigned int start;
+	unsigned int length;
+};
+
+void timer_init(unsigned int frequency);
+int timer_present();
+unsigned int timer_cycles();
+
+void timer_window_start(struct timer_window *w, unsigned int ms);
+int timer_window_expired(struct timer_window *w);
+
+#endif /* __TIMER_H */
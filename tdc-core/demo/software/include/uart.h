@@ -24,6 +24,8 @@ void uart_async_isr_tx();
 void uart_force_sync(int f);
 
 void writechar(char c);
+void uart_write(const char *buf, int len);
+int uart_write_nonblock(const char *buf, int len);
 char readchar();
 int readchar_nonblock();
 
@@ -0,0 +1,81 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2010 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <divide.h>
+#include "libgcc_lm32.h"
+
+/*
+ * 64-bit division, on top of udivmod64(). A zero divisor goes through
+ * __udivsi3, which raises the divide by zero exception.
+ */
+
+UDItype __udivdi3(UDItype a, UDItype b)
+{
+	if(b == 0)
+		return __udivsi3(1, 0);
+	return udivmod64(a, b, NULL);
+}
+
+UDItype __umoddi3(UDItype a, UDItype b)
+{
+	unsigned long long rem;
+
+	if(b == 0)
+		return __udivsi3(1, 0);
+	udivmod64(a, b, &rem);
+	return rem;
+}
+
+DItype __divdi3(DItype a, DItype b)
+{
+	int neg;
+	DItype res;
+
+	if(b == 0)
+		return __udivsi3(1, 0);
+	neg = 0;
+	if(a < 0) {
+		a = -a;
+		neg = !neg;
+	}
+	if(b < 0) {
+		b = -b;
+		neg = !neg;
+	}
+	res = udivmod64(a, b, NULL);
+	return neg ? -res : res;
+}
+
+/* The remainder takes the sign of the dividend */
+DItype __moddi3(DItype a, DItype b)
+{
+	int neg;
+	unsigned long long rem;
+
+	if(b == 0)
+		return __udivsi3(1, 0);
+	neg = 0;
+	if(a < 0) {
+		a = -a;
+		neg = 1;
+	}
+	if(b < 0)
+		b = -b;
+	udivmod64(a, b, &rem);
+	return neg ? -(DItype)rem : (DItype)rem;
+}
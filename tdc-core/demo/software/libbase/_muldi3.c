@@ -0,0 +1,62 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2010 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libgcc_lm32.h"
+
+/*
+ * Low 64 bits of the product. Without hardware multiplier, the full
+ * 32x32 product of the low words loops over the bits of the smaller
+ * one; the cross products only need their low words.
+ */
+DItype __muldi3(DItype a, DItype b)
+{
+	DWunion ua, ub, p;
+	USItype mhi, mlo, small, t;
+
+	ua.ll = a;
+	ub.ll = b;
+
+	p.s.high = 0;
+	if(ua.s.high != 0)
+		p.s.high += __mulsi3(ua.s.high, ub.s.low);
+	if(ub.s.high != 0)
+		p.s.high += __mulsi3(ua.s.low, ub.s.high);
+
+	mlo = ua.s.low;
+	small = ub.s.low;
+	if(mlo < small) {
+		t = mlo;
+		mlo = small;
+		small = t;
+	}
+	mhi = 0;
+	p.s.low = 0;
+	while(small != 0) {
+		if(small & 1) {
+			p.s.low += mlo;
+			if(p.s.low < mlo)
+				p.s.high++;
+			p.s.high += mhi;
+		}
+		mhi += mhi;
+		if(mlo & 0x80000000)
+			mhi++;
+		mlo += mlo;
+		small >>= 1;
+	}
+	return p.ll;
+}
@@ -0,0 +1,74 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2010 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libgcc_lm32.h"
+
+/* 64-bit shifts on 32-bit halves, the counts are taken modulo 64 */
+
+DItype __ashldi3(DItype a, int b)
+{
+	DWunion u;
+
+	b &= 63;
+	if(b == 0)
+		return a;
+	u.ll = a;
+	if(b >= 32) {
+		u.s.high = u.s.low << (b - 32);
+		u.s.low = 0;
+	} else {
+		u.s.high = (u.s.high << b) | (u.s.low >> (32 - b));
+		u.s.low <<= b;
+	}
+	return u.ll;
+}
+
+UDItype __lshrdi3(UDItype a, int b)
+{
+	DWunion u;
+
+	b &= 63;
+	if(b == 0)
+		return a;
+	u.ll = a;
+	if(b >= 32) {
+		u.s.low = u.s.high >> (b - 32);
+		u.s.high = 0;
+	} else {
+		u.s.low = (u.s.low >> b) | (u.s.high << (32 - b));
+		u.s.high >>= b;
+	}
+	return u.ll;
+}
+
+DItype __ashrdi3(DItype a, int b)
+{
+	DWunion u;
+
+	b &= 63;
+	if(b == 0)
+		return a;
+	u.ll = a;
+	if(b >= 32) {
+		u.s.low = (SItype)u.s.high >> (b - 32);
+		u.s.high = (SItype)u.s.high < 0 ? 0xffffffff : 0;
+	} else {
+		u.s.low = (u.s.low >> b) | (u.s.high << (32 - b));
+		u.s.high = (SItype)u.s.high >> b;
+	}
+	return u.ll;
+}
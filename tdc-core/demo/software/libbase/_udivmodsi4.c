@@ -22,32 +22,18 @@
    see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
    <http://www.gnu.org/licenses/>. */
 
+#include <divide.h>
 #include "libgcc_lm32.h"
 
-/* Unsigned integer division/modulus.  */
 
 USItype
 __udivmodsi4 (USItype num, USItype den, int modwanted)
 {
-  USItype bit = 1;
-  USItype res = 0;
+  unsigned int rem;
+  USItype res;
 
-  while (den < num && bit && !(den & (1L << 31)))
-    {
-      den <<= 1;
-      bit <<= 1;
-    }
-  while (bit)
-    {
-      if (num >= den)
-	{
-	  num -= den;
-	  res |= bit;
-	}
-      bit >>= 1;
-      den >>= 1;
-    }
+  res = udivmod (num, den, &rem);
   if (modwanted)
-    return num;
+    return rem;
   return res;
 }
@@ -25,6 +25,7 @@ static const struct board_desc boards[1] = {
 		.id = 0x53504543, /* SPEC */
 		.name = "SPEC",
 		.clk_frequency = 125000000,
+		.fastboot_gpio = 0x00000004, /* btn<2>, pin A3, pulled down */
 	},
 };
 
@@ -19,23 +19,18 @@
 #include <console.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 
 int puts(const char *s)
 {
-	while(*s) {
-		writechar(*s);
-		s++;
-	}
+	uart_write(s, strlen(s));
 	writechar('\n');
 	return 1;
 }
 
 void putsnonl(const char *s)
 {
-	while(*s) {
-		writechar(*s);
-		s++;
-	}
+	uart_write(s, strlen(s));
 }
 
 void readstr(char *s, int size)
@@ -78,7 +73,7 @@ int printf(const char *fmt, ...)
 	len = vscnprintf(outbuf, sizeof(outbuf), fmt, args);
 	va_end(args);
 	outbuf[len] = 0;
-	putsnonl(outbuf);
+	uart_write(outbuf, len);
 
 	return len;
 }
@@ -0,0 +1,256 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2010 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <divide.h>
+
+/*
+ * The CPU has neither multiplier nor barrel shifter: a shift costs one
+ * instruction per bit, and a reciprocal multiplication would cost as
+ * much as the division itself. Shifts and compares are kept to the
+ * bits of the quotient instead.
+ */
+
+/* One quotient bit, den moves right towards the remainder */
+#define STEP() \
+	do { \
+		q += q; \
+		if(num >= den) { \
+			num -= den; \
+			q++; \
+		} \
+		den >>= 1; \
+	} while(0)
+
+/* num < 2*den, the quotient has n bits at most */
+static unsigned int divide_steps(unsigned int num, unsigned int den, int n, unsigned int *rem)
+{
+	unsigned int q;
+
+	q = 0;
+	switch(n & 3) {
+		case 0: do { STEP();
+		case 3: STEP();
+		case 2: STEP();
+		case 1: STEP();
+			} while((n -= 4) > 0);
+	}
+	if(rem)
+		*rem = num;
+	return q;
+}
+
+/* Shift-and-add reciprocal of 10, exact after one correction */
+static unsigned int divide10(unsigned int num, unsigned int *rem)
+{
+	unsigned int q, r;
+
+	q = (num >> 1) + (num >> 2);
+	q += q >> 4;
+	q += q >> 8;
+	q += q >> 16;
+	q >>= 3;
+	r = num - ((q << 3) + (q << 1));
+	if(r > 9) {
+		q++;
+		r -= 10;
+	}
+	if(rem)
+		*rem = r;
+	return q;
+}
+
+unsigned int udivmod(unsigned int num, unsigned int den, unsigned int *rem)
+{
+	unsigned int half;
+	int n;
+
+	if(den > num) {
+		if(rem)
+			*rem = num;
+		return 0;
+	}
+	if((den & (den - 1)) == 0) {
+		if(rem)
+			*rem = num & (den - 1);
+		while(den > 1) {
+			den >>= 1;
+			num >>= 1;
+		}
+		return num;
+	}
+	if(den == 10)
+		return divide10(num, rem);
+
+	/* Align den under num, four bits at a time first */
+	n = 1;
+	half = num >> 4;
+	while(den <= half) {
+		den <<= 4;
+		n += 4;
+	}
+	half = num >> 1;
+	while(den <= half) {
+		den += den;
+		n++;
+	}
+	return divide_steps(num, den, n, rem);
+}
+
+void udiv_const_init(struct udiv_const *d, unsigned int divisor)
+{
+	unsigned int v;
+	int s;
+
+	d->divisor = divisor;
+	s = 0;
+	if((divisor & (divisor - 1)) == 0) {
+		for(v=divisor;v>1;v>>=1)
+			s++;
+		d->normalized = 0;
+		d->shift = s;
+	} else {
+		v = divisor;
+		while(!(v & 0x80000000)) {
+			v += v;
+			s++;
+		}
+		d->normalized = v;
+		d->shift = s;
+	}
+}
+
+unsigned int udiv_const(const struct udiv_const *d, unsigned int num, unsigned int *rem)
+{
+	int s;
+
+	if(d->normalized == 0) {
+		if(rem)
+			*rem = num & (d->divisor - 1);
+		for(s=d->shift;s>0;s--)
+			num >>= 1;
+		return num;
+	}
+	if(num < d->divisor) {
+		if(rem)
+			*rem = num;
+		return 0;
+	}
+	if(d->divisor == 10)
+		return divide10(num, rem);
+	/* No alignment: the normalised divisor gives shift+1 quotient bits */
+	return divide_steps(num, d->normalized, d->shift + 1, rem);
+}
+
+/* (hi:lo)/den with hi < den: 32 quotient bits, shifted in as lo goes out */
+static unsigned int divide_64_32(unsigned int hi, unsigned int lo, unsigned int den, unsigned int *rem)
+{
+	unsigned int carry;
+	int i;
+
+	for(i=0;i<32;i++) {
+		carry = hi & 0x80000000;
+		hi += hi;
+		if(lo & 0x80000000)
+			hi++;
+		lo += lo;
+		if(carry || (hi >= den)) {
+			hi -= den;
+			lo++;
+		}
+	}
+	*rem = hi;
+	return lo;
+}
+
+/* (ahi:alo) >= (bhi:blo) */
+#define GE64(ahi, alo, bhi, blo) (((ahi) > (bhi)) || (((ahi) == (bhi)) && ((alo) >= (blo))))
+
+unsigned long long udivmod64(unsigned long long num, unsigned long long den, unsigned long long *rem)
+{
+	unsigned int nhi, nlo, dhi, dlo;
+	unsigned int qhi, qlo, r;
+	unsigned int thi, tlo;
+	int n;
+
+	nhi = num >> 32;
+	nlo = num;
+	dhi = den >> 32;
+	dlo = den;
+
+	if(dhi == 0) {
+		qhi = 0;
+		if(nhi == 0)
+			qlo = udivmod(nlo, dlo, &r);
+		else if((dlo & (dlo - 1)) == 0) {
+			r = nlo & (dlo - 1);
+			while(dlo > 1) {
+				dlo >>= 1;
+				nlo >>= 1;
+				if(nhi & 1)
+					nlo |= 0x80000000;
+				nhi >>= 1;
+			}
+			qhi = nhi;
+			qlo = nlo;
+		} else {
+			/* Two 32-bit quotient halves */
+			if(nhi >= dlo)
+				qhi = udivmod(nhi, dlo, &nhi);
+			qlo = divide_64_32(nhi, nlo, dlo, &r);
+		}
+		if(rem)
+			*rem = r;
+		return ((unsigned long long)qhi << 32) | qlo;
+	}
+
+	/* Wide divisor, the quotient has 32 bits at most */
+	if(!GE64(nhi, nlo, dhi, dlo)) {
+		if(rem)
+			*rem = num;
+		return 0;
+	}
+	n = 1;
+	while(!(dhi & 0x80000000)) {
+		thi = dhi + dhi;
+		if(dlo & 0x80000000)
+			thi++;
+		tlo = dlo + dlo;
+		if(!GE64(nhi, nlo, thi, tlo))
+			break;
+		dhi = thi;
+		dlo = tlo;
+		n++;
+	}
+	qlo = 0;
+	while(n-- > 0) {
+		qlo += qlo;
+		if(GE64(nhi, nlo, dhi, dlo)) {
+			nhi -= dhi;
+			if(nlo < dlo)
+				nhi--;
+			nlo -= dlo;
+			qlo++;
+		}
+		dlo >>= 1;
+		if(dhi & 1)
+			dlo |= 0x80000000;
+		dhi >>= 1;
+	}
+	if(rem)
+		*rem = ((unsigned long long)nhi << 32) | nlo;
+	return qlo;
+}
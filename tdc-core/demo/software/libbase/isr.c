@@ -0,0 +1,107 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2011 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <irq.h>
+
+struct irq_vector {
+	unsigned int mask;
+	irq_handler handler;
+	int priority;
+};
+
+/* Sorted by priority, one entry per interrupt line at most */
+static struct irq_vector vectors[32];
+static int nvectors;
+
+/* Called by the TDC entry in crt0.S, the dispatcher until replaced */
+irq_handler irq_fast_handler = isr;
+
+static int remove_vector(unsigned int irq)
+{
+	int i;
+
+	for(i=0;i<nvectors;i++)
+		if(vectors[i].mask == irq)
+			break;
+	if(i == nvectors)
+		return 0;
+	nvectors--;
+	for(;i<nvectors;i++)
+		vectors[i] = vectors[i+1];
+	return 1;
+}
+
+int irq_attach(unsigned int irq, irq_handler handler, int priority)
+{
+	unsigned int ie;
+	int i;
+
+	/* Exactly one line */
+	if((irq == 0) || ((irq & (irq - 1)) != 0) || (handler == 0))
+		return 0;
+
+	ie = irq_isenabled();
+	irq_enable(0);
+	remove_vector(irq);
+	/* After the lines of the same priority */
+	for(i=nvectors;(i > 0) && (vectors[i-1].priority > priority);i--)
+		vectors[i] = vectors[i-1];
+	vectors[i].mask = irq;
+	vectors[i].handler = handler;
+	vectors[i].priority = priority;
+	nvectors++;
+	irq_enable(ie);
+	return 1;
+}
+
+void irq_detach(unsigned int irq)
+{
+	unsigned int ie;
+
+	ie = irq_isenabled();
+	irq_enable(0);
+	remove_vector(irq);
+	irq_enable(ie);
+}
+
+void irq_attach_fast(irq_handler handler)
+{
+	irq_fast_handler = handler ? handler : isr;
+}
+
+/*
+ * Called from the interrupt entry in crt0.S.
+ * The pending lines are read again after each handler, so that a
+ * higher priority interrupt arriving meanwhile is served first.
+ */
+void isr()
+{
+	unsigned int irqs;
+	int i;
+
+	while((irqs = irq_pending() & irq_getmask()) != 0) {
+		for(i=0;i<nvectors;i++)
+			if(irqs & vectors[i].mask)
+				break;
+		if(i == nvectors) {
+			/* Nobody serves these lines, mask them instead of looping */
+			irq_setmask(irq_getmask() & ~irqs);
+			break;
+		}
+		vectors[i].handler();
+	}
+}
@@ -22,6 +22,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <limits.h>
+#include <divide.h>
 
 /**
  * strchr - Find the first occurrence of a character in a string
@@ -169,6 +170,15 @@ size_t strnlen(const char *s, size_t count)
 	return sc - s;
 }
 
+/*
+ * The memory functions below move whole words, eight at a time, when both
+ * areas have the same alignment. Otherwise they go one byte at a time:
+ * the LM32 of the SoC has no barrel shifter, and merging misaligned words
+ * would cost more than the extra bus cycles.
+ */
+#define WORD_MASK	(sizeof(unsigned int)-1)
+#define CO_ALIGNED(a, b) ((((unsigned long)(a) ^ (unsigned long)(b)) & WORD_MASK) == 0)
+
 /**
  * memcmp - Compare two areas of memory
  * @cs: One area of memory
@@ -178,9 +188,27 @@ size_t strnlen(const char *s, size_t count)
 int memcmp(const void *cs, const void *ct, size_t count)
 {
 	const unsigned char *su1, *su2;
+	const unsigned int *w1, *w2;
 	int res = 0;
 
-	for (su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
+	su1 = cs;
+	su2 = ct;
+	if (CO_ALIGNED(su1, su2) && (count >= 8)) {
+		for (; (unsigned long)su1 & WORD_MASK; ++su1, ++su2, count--)
+			if ((res = *su1 - *su2) != 0)
+				return res;
+		/* Skip the equal words, the bytes of a different one give the sign */
+		w1 = (const unsigned int *)su1;
+		w2 = (const unsigned int *)su2;
+		while ((count >= 4) && (*w1 == *w2)) {
+			w1++;
+			w2++;
+			count -= 4;
+		}
+		su1 = (const unsigned char *)w1;
+		su2 = (const unsigned char *)w2;
+	}
+	for (; 0 < count; ++su1, ++su2, count--)
 		if ((res = *su1 - *su2) != 0)
 			break;
 	return res;
@@ -195,7 +223,36 @@ int memcmp(const void *cs, const void *ct, size_t count)
 void *memset(void *s, int c, size_t count)
 {
 	char *xs = s;
+	unsigned int *ws;
+	unsigned int word;
 
+	if (count >= 16) {
+		while ((unsigned long)xs & WORD_MASK) {
+			*xs++ = c;
+			count--;
+		}
+		word = c & 0xff;
+		word |= word << 8;
+		word |= word << 16;
+		ws = (unsigned int *)xs;
+		while (count >= 32) {
+			ws[0] = word;
+			ws[1] = word;
+			ws[2] = word;
+			ws[3] = word;
+			ws[4] = word;
+			ws[5] = word;
+			ws[6] = word;
+			ws[7] = word;
+			ws += 8;
+			count -= 32;
+		}
+		while (count >= 4) {
+			*ws++ = word;
+			count -= 4;
+		}
+		xs = (char *)ws;
+	}
 	while (count--)
 		*xs++ = c;
 	return s;
@@ -206,16 +263,55 @@ void *memset(void *s, int c, size_t count)
  * @dest: Destination
  * @src: Source
  * @n: The size to copy.
+ *
+ * Copies in increasing addresses, which memmove relies on when @dest
+ * is below @src.
  */
 void *memcpy(void *dest, const void *src, size_t n)
 {
 	char *_dest = (char *)dest;
-	char *_src = (char *)src;
-	size_t i;
-
-	for(i=0;i<n;i++)
-		_dest[i] = _src[i];
-
+	const char *_src = (const char *)src;
+	unsigned int *dw;
+	const unsigned int *sw;
+
+	if (CO_ALIGNED(_dest, _src) && (n >= 8)) {
+		while ((unsigned long)_dest & WORD_MASK) {
+			*_dest++ = *_src++;
+			n--;
+		}
+		dw = (unsigned int *)_dest;
+		sw = (const unsigned int *)_src;
+		while (n >= 32) {
+			dw[0] = sw[0];
+			dw[1] = sw[1];
+			dw[2] = sw[2];
+			dw[3] = sw[3];
+			dw[4] = sw[4];
+			dw[5] = sw[5];
+			dw[6] = sw[6];
+			dw[7] = sw[7];
+			dw += 8;
+			sw += 8;
+			n -= 32;
+		}
+		while (n >= 4) {
+			*dw++ = *sw++;
+			n -= 4;
+		}
+		_dest = (char *)dw;
+		_src = (const char *)sw;
+	}
+	while (n >= 4) {
+		_dest[0] = _src[0];
+		_dest[1] = _src[1];
+		_dest[2] = _src[2];
+		_dest[3] = _src[3];
+		_dest += 4;
+		_src += 4;
+		n -= 4;
+	}
+	while (n--)
+		*_dest++ = *_src++;
 	return dest;
 }
 
@@ -227,24 +323,49 @@ void *memcpy(void *dest, const void *src, size_t n)
  */
 void *memmove(void *dest, const void *src, size_t count)
 {
-	char *tmp, *s;
-
-	if(dest <= src) {
-		tmp = (char *) dest;
-		s = (char *) src;
-		while(count--)
-			*tmp++ = *s++;
-	} else {
-		tmp = (char *)dest + count;
-		s = (char *)src + count;
-		while(count--)
+	char *tmp;
+	const char *s;
+	unsigned int *dw;
+	const unsigned int *sw;
+
+	if ((dest <= src) || ((const char *)src + count <= (char *)dest))
+		return memcpy(dest, src, count);
+
+	/* Overlap with the destination above: copy downwards */
+	tmp = (char *)dest + count;
+	s = (const char *)src + count;
+	if (CO_ALIGNED(tmp, s) && (count >= 8)) {
+		while ((unsigned long)tmp & WORD_MASK) {
 			*--tmp = *--s;
+			count--;
+		}
+		dw = (unsigned int *)tmp;
+		sw = (const unsigned int *)s;
+		while (count >= 32) {
+			dw -= 8;
+			sw -= 8;
+			dw[7] = sw[7];
+			dw[6] = sw[6];
+			dw[5] = sw[5];
+			dw[4] = sw[4];
+			dw[3] = sw[3];
+			dw[2] = sw[2];
+			dw[1] = sw[1];
+			dw[0] = sw[0];
+			count -= 32;
+		}
+		while (count >= 4) {
+			*--dw = *--sw;
+			count -= 4;
+		}
+		tmp = (char *)dw;
+		s = (const char *)sw;
 	}
-
+	while (count--)
+		*--tmp = *--s;
 	return dest;
 }
 
-
 /**
  * strtoul - convert a string to an unsigned long
  * @nptr: The start of the string
@@ -301,10 +422,11 @@ int skip_atoi(const char **s)
 	return i;
 }
 
-char *number(char *buf, char *end, unsigned long num, int base, int size, int precision, int type)
+char *number(char *buf, char *end, unsigned long long num, int base, int size, int precision, int type)
 {
 	char c,sign,tmp[66];
 	const char *digits;
+	unsigned long long rem;
 	static const char small_digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
 	static const char large_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 	int i;
@@ -317,9 +439,9 @@ char *number(char *buf, char *end, unsigned long num, int base, int size, int pr
 	c = (type & PRINTF_ZEROPAD) ? '0' : ' ';
 	sign = 0;
 	if (type & PRINTF_SIGN) {
-		if ((signed long) num < 0) {
+		if ((signed long long) num < 0) {
 			sign = '-';
-			num = - (signed long) num;
+			num = - (signed long long) num;
 			size--;
 		} else if (type & PRINTF_PLUS) {
 			sign = '+';
@@ -339,8 +461,9 @@ char *number(char *buf, char *end, unsigned long num, int base, int size, int pr
 	if (num == 0)
 		tmp[i++]='0';
 	else while (num != 0) {
-		tmp[i++] = digits[num % base];
-		num = num / base;
+		/* One division for both, 32-bit once the high word is gone */
+		num = udivmod64(num, base, &rem);
+		tmp[i++] = digits[rem];
 	}
 	if (i > precision)
 		precision = i;
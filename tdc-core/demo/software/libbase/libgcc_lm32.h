@@ -30,6 +30,22 @@
 typedef unsigned char UQItype __attribute__ ((mode (QI)));
 typedef long SItype __attribute__ ((mode (SI)));
 typedef unsigned long USItype __attribute__ ((mode (SI)));
+typedef long long DItype __attribute__ ((mode (DI)));
+typedef unsigned long long UDItype __attribute__ ((mode (DI)));
+
+/* Halves of a 64-bit value: LM32 is big-endian, the host tests are not */
+typedef union
+{
+  struct
+  {
+#if defined (__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    USItype low, high;
+#else
+    USItype high, low;
+#endif
+  } s;
+  DItype ll;
+} DWunion;
 
 /* Prototypes.  */
 
@@ -40,4 +56,13 @@ SItype __modsi3 (SItype a, SItype b);
 USItype __udivsi3 (USItype a, USItype b);
 USItype __umodsi3 (USItype a, USItype b);
 
+DItype __muldi3 (DItype a, DItype b);
+UDItype __udivdi3 (UDItype a, UDItype b);
+UDItype __umoddi3 (UDItype a, UDItype b);
+DItype __divdi3 (DItype a, DItype b);
+DItype __moddi3 (DItype a, DItype b);
+DItype __ashldi3 (DItype a, int b);
+DItype __ashrdi3 (DItype a, int b);
+UDItype __lshrdi3 (UDItype a, int b);
+
 #endif /* LIBGCC_LM32_H */
@@ -0,0 +1,98 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2010 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <irq.h>
+#include <hw/sysctl.h>
+#include <hw/interrupts.h>
+
+#include <pcprof.h>
+
+/* Counts saturate instead of wrapping */
+static unsigned short histogram[PCPROF_BUCKETS];
+static unsigned int base;
+static unsigned int size;
+static unsigned int shift;
+static unsigned int samples;
+static unsigned int outside;
+
+static void pcprof_isr()
+{
+	unsigned int pc;
+	unsigned int offset;
+
+	/* The dispatcher leaves ea alone: it is still the interrupted PC */
+	__asm__ __volatile__("mv %0, ea" : "=r"(pc));
+	irq_ack(IRQ_TIMER1);
+
+	samples++;
+	offset = pc - base;
+	if(offset >= size) {
+		outside++;
+		return;
+	}
+	offset >>= shift;
+	if(histogram[offset] != 0xffff)
+		histogram[offset]++;
+}
+
+void pcprof_start(unsigned int b, unsigned int s, unsigned int period)
+{
+	int i;
+
+	pcprof_stop();
+
+	base = b;
+	size = s;
+	/* At least one instruction per bucket */
+	shift = 2;
+	while(((size - 1) >> shift) >= PCPROF_BUCKETS)
+		shift++;
+	for(i=0;i<PCPROF_BUCKETS;i++)
+		histogram[i] = 0;
+	samples = 0;
+	outside = 0;
+
+	/* Below the UART, whose FIFOs would overflow */
+	irq_attach(IRQ_TIMER1, pcprof_isr, 3);
+	CSR_TIMER1_COMPARE = period;
+	CSR_TIMER1_COUNTER = 0;
+	irq_ack(IRQ_TIMER1);
+	irq_setmask(irq_getmask() | IRQ_TIMER1);
+	CSR_TIMER1_CONTROL = TIMER_ENABLE|TIMER_AUTORESTART;
+}
+
+void pcprof_stop()
+{
+	CSR_TIMER1_CONTROL = 0;
+	irq_setmask(irq_getmask() & ~IRQ_TIMER1);
+	irq_ack(IRQ_TIMER1);
+	irq_detach(IRQ_TIMER1);
+}
+
+/* Only the buckets with samples, as "address count" */
+void pcprof_dump()
+{
+	unsigned int i;
+
+	printf("pcprof base %08x shift %u samples %u outside %u\n",
+		base, shift, samples, outside);
+	for(i=0;i<PCPROF_BUCKETS;i++)
+		if(histogram[i] != 0)
+			printf("%08x %u\n", base + (i << shift), histogram[i]);
+	printf("pcprof end\n");
+}
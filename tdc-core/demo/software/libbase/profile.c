@@ -0,0 +1,117 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2010 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <irq.h>
+#include <hw/sysctl.h>
+
+#include <profile.h>
+
+static struct profile_region *regions;
+static unsigned int overhead;
+static int present;
+
+unsigned long long profile_cycles()
+{
+	unsigned int ie;
+	unsigned int lo, hi;
+
+	/* An interrupt handler could take its own snapshot in between */
+	ie = irq_isenabled();
+	irq_enable(0);
+	CSR_CYCLES_LO = 0;
+	lo = CSR_CYCLES_LO;
+	hi = CSR_CYCLES_HI;
+	irq_enable(ie);
+	return ((unsigned long long)hi << 32) | lo;
+}
+
+void profile_init()
+{
+	struct profile_region r = PROFILE_REGION("overhead");
+	int i;
+
+	/* The CSRs read as 0 without the cycle counter */
+	present = profile_cycles() != 0;
+	overhead = 0;
+	/* Keep it off the list, it lives on the stack */
+	r.listed = 1;
+	for(i=0;i<4;i++) {
+		profile_start(&r);
+		profile_stop(&r);
+	}
+	overhead = r.min;
+}
+
+int profile_present()
+{
+	return present;
+}
+
+void profile_start(struct profile_region *r)
+{
+	r->start = profile_cycles();
+}
+
+void profile_stop(struct profile_region *r)
+{
+	unsigned long long elapsed;
+	unsigned int cycles;
+
+	elapsed = profile_cycles() - r->start;
+	elapsed = elapsed > overhead ? elapsed - overhead : 0;
+	r->total += elapsed;
+	/* min and max saturate, a region is not expected to last 34s */
+	cycles = (elapsed >> 32) != 0 ? 0xffffffff : elapsed;
+	if((r->count == 0) || (cycles < r->min))
+		r->min = cycles;
+	if(cycles > r->max)
+		r->max = cycles;
+	r->count++;
+	if(!r->listed) {
+		r->listed = 1;
+		r->next = regions;
+		regions = r;
+	}
+}
+
+void profile_clear()
+{
+	struct profile_region *r;
+
+	for(r=regions;r!=NULL;r=r->next) {
+		r->count = 0;
+		r->min = 0;
+		r->max = 0;
+		r->total = 0;
+	}
+}
+
+void profile_dump()
+{
+	struct profile_region *r;
+
+	if(!present) {
+		printf("No cycle counter\n");
+		return;
+	}
+	printf("region                count        min        max                total\n");
+	for(r=regions;r!=NULL;r=r->next)
+		printf("%-16s %10u %10u %10u %20llu\n", r->name,
+			r->count, r->min, r->max, r->total);
+	printf("Start/stop overhead: %u cycles\n", overhead);
+}
@@ -0,0 +1,69 @@
+/*
+ * Milkymist SoC (Software)
+ * Copyright (C) 2007, 2008, 2009, 2010 Sebastien Bourdeauducq
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <hw/sysctl.h>
+
+#include <timer.h>
+
+/* Polls per millisecond of a UART wait loop, used without the timer */
+#define POLLS_PER_MS 4500
+
+static int present;
+static unsigned int cycles_per_ms;
+
+void timer_init(unsigned int frequency)
+{
+	cycles_per_ms = frequency/1000;
+	CSR_TIMER0_CONTROL = 0;
+	CSR_TIMER0_COMPARE = 0xffffffff;
+	CSR_TIMER0_COUNTER = 0;
+	CSR_TIMER0_CONTROL = TIMER_ENABLE|TIMER_AUTORESTART;
+	/* The CSRs read as 0 without the system controller */
+	present = (CSR_TIMER0_COUNTER != 0) && (cycles_per_ms != 0);
+}
+
+int timer_present()
+{
+	return present;
+}
+
+/* Wraps around every 2^32 cycles */
+unsigned int timer_cycles()
+{
+	return CSR_TIMER0_COUNTER;
+}
+
+void timer_window_start(struct timer_window *w, unsigned int ms)
+{
+	if(present) {
+		w->start = CSR_TIMER0_COUNTER;
+		/* Keep clear of the wrap-around */
+		if(ms > 0x7fffffff/cycles_per_ms)
+			ms = 0x7fffffff/cycles_per_ms;
+		w->length = ms*cycles_per_ms;
+	} else {
+		w->start = 0;
+		w->length = ms*POLLS_PER_MS;
+	}
+}
+
+int timer_window_expired(struct timer_window *w)
+{
+	if(present)
+		return CSR_TIMER0_COUNTER - w->start >= w->length;
+	return w->start++ >= w->length;
+}
@@ -15,6 +15,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
 #include <uart.h>
 #include <irq.h>
 #include <hw/uart.h>
@@ -23,29 +24,77 @@
 /*
  * Buffer sizes must be a power of 2 so that modulos can be computed
  * with logical AND.
- * RX functions are written in such a way that they do not require locking.
- * TX functions already implement locking.
+ * The hardware FIFOs are emptied and filled in bursts, from the interrupt
+ * handlers or with the corresponding interrupt masked.
+ * The buffers live in the 8KB BIOS SRAM, with the stack and the serial
+ * boot frame (4KB). The RX ring only has to cover the time the BIOS
+ * spends away from the line, at most a few milliseconds per serial boot
+ * frame (decompression, CRC of a block): 512 characters last 5ms at
+ * 1Mbps. Senders block while the TX ring is full, so it only smooths
+ * out console output.
  */
 
-#define UART_RINGBUFFER_SIZE_RX 4096
+static unsigned int fifo_depth;
+
+#ifndef UART_RINGBUFFER_SIZE_RX
+#define UART_RINGBUFFER_SIZE_RX 512
+#endif
 #define UART_RINGBUFFER_MASK_RX (UART_RINGBUFFER_SIZE_RX-1)
 
 static char rx_buf[UART_RINGBUFFER_SIZE_RX];
 static volatile unsigned int rx_produce;
 static volatile unsigned int rx_consume;
 
+static void rx_drain()
+{
+	unsigned int level;
+	unsigned int next;
+	char c;
+
+	while((level = CSR_UART_RXLEVEL) != 0) {
+		while(level-- > 0) {
+			c = CSR_UART_RXTX;
+			CSR_UART_RXLEVEL = 1;
+			next = (rx_produce + 1) & UART_RINGBUFFER_MASK_RX;
+			/* On overflow, drop the new character rather than the whole buffer */
+			if(next != rx_consume) {
+				rx_buf[rx_produce] = c;
+				rx_produce = next;
+			}
+		}
+	}
+}
+
 void uart_async_isr_rx()
 {
 	irq_ack(IRQ_UARTRX);
-	rx_buf[rx_produce] = CSR_UART_RXTX;
-	rx_produce = (rx_produce + 1) & UART_RINGBUFFER_MASK_RX;
+	rx_drain();
+}
+
+/*
+ * The RX interrupt only comes once the FIFO reaches its threshold or
+ * after a timeout. When the CPU is waiting for data anyway, it picks
+ * it up directly.
+ */
+static int rx_poll()
+{
+	unsigned int oldmask;
+
+	if(CSR_UART_RXLEVEL == 0)
+		return 0;
+	oldmask = irq_getmask();
+	irq_setmask(oldmask & (~IRQ_UARTRX));
+	rx_drain();
+	irq_setmask(oldmask);
+	return 1;
 }
 
 char readchar()
 {
 	char c;
 	
-	while(rx_consume == rx_produce);
+	while(rx_consume == rx_produce)
+		rx_poll();
 	c = rx_buf[rx_consume];
 	rx_consume = (rx_consume + 1) & UART_RINGBUFFER_MASK_RX;
 	return c;
@@ -53,50 +102,122 @@ char readchar()
 
 int readchar_nonblock()
 {
-	return (rx_consume != rx_produce);
+	return (rx_consume != rx_produce) || rx_poll();
 }
 
-#define UART_RINGBUFFER_SIZE_TX 131072
+#ifndef UART_RINGBUFFER_SIZE_TX
+#define UART_RINGBUFFER_SIZE_TX 256
+#endif
 #define UART_RINGBUFFER_MASK_TX (UART_RINGBUFFER_SIZE_TX-1)
 
 static char tx_buf[UART_RINGBUFFER_SIZE_TX];
 static unsigned int tx_produce;
 static unsigned int tx_consume;
-static volatile int tx_cts;
 
 static int force_sync;
 
-void uart_async_isr_tx()
+/* TXLEVEL counts the character being sent, hence the FIFO may hold one more */
+static void tx_fill()
 {
-	irq_ack(IRQ_UARTTX);
-	if(tx_produce != tx_consume) {
+	unsigned int level;
+
+	level = CSR_UART_TXLEVEL;
+	while((level < fifo_depth) && (tx_produce != tx_consume)) {
 		CSR_UART_RXTX = tx_buf[tx_consume];
 		tx_consume = (tx_consume + 1) & UART_RINGBUFFER_MASK_TX;
-	} else
-		tx_cts = 1;
+		level++;
+	}
 }
 
-void writechar(char c)
+void uart_async_isr_tx()
 {
-	unsigned int oldmask = 0;
-	
-	/* Synchronization required because of CTS */
+	irq_ack(IRQ_UARTTX);
+	tx_fill();
+}
+
+/* Copies as much of buf as the ring can take, returns the length copied */
+static int tx_put(const char *buf, int len)
+{
+	int room;
+	int n;
+	int copied;
+
+	copied = 0;
+	while(len > 0) {
+		room = (tx_consume - tx_produce - 1) & UART_RINGBUFFER_MASK_TX;
+		if(room == 0)
+			break;
+		/* Up to the end of the buffer at most */
+		n = UART_RINGBUFFER_SIZE_TX - tx_produce;
+		if(n > room) n = room;
+		if(n > len) n = len;
+		memcpy(&tx_buf[tx_produce], buf, n);
+		tx_produce = (tx_produce + n) & UART_RINGBUFFER_MASK_TX;
+		buf += n;
+		len -= n;
+		copied += n;
+	}
+	return copied;
+}
+
+/*
+ * The whole string goes out with the TX interrupt masked only once,
+ * since the ISR also sends from the buffer.
+ */
+void uart_write(const char *buf, int len)
+{
+	unsigned int oldmask;
+	int n;
+
 	oldmask = irq_getmask();
 	irq_setmask(oldmask & (~IRQ_UARTTX));
 	if(force_sync) {
-		CSR_UART_RXTX = c;
-		while(!(irq_pending() & IRQ_UARTTX));
-		irq_ack(IRQ_UARTTX);
+		while(len-- > 0) {
+			while(CSR_UART_TXLEVEL > fifo_depth);
+			CSR_UART_RXTX = *buf++;
+		}
+		while(CSR_UART_TXLEVEL != 0);
 	} else {
-		if(tx_cts) {
-			tx_cts = 0;
-			CSR_UART_RXTX = c;
-		} else {
-			tx_buf[tx_produce] = c;
-			tx_produce = (tx_produce + 1) & UART_RINGBUFFER_MASK_TX;
+		while(len > 0) {
+			n = tx_put(buf, len);
+			buf += n;
+			len -= n;
+			/* Buffer full: make room by feeding the FIFO ourselves */
+			tx_fill();
+		}
+	}
+	irq_setmask(oldmask);
+}
+
+/*
+ * Queues what fits without waiting for the UART.
+ * Returns the number of characters dropped.
+ */
+int uart_write_nonblock(const char *buf, int len)
+{
+	unsigned int oldmask;
+	unsigned int level;
+	int n;
+
+	oldmask = irq_getmask();
+	irq_setmask(oldmask & (~IRQ_UARTTX));
+	if(force_sync) {
+		level = CSR_UART_TXLEVEL;
+		for(n=0;(n < len) && (level < fifo_depth);n++) {
+			CSR_UART_RXTX = buf[n];
+			level++;
 		}
+	} else {
+		n = tx_put(buf, len);
+		tx_fill();
 	}
 	irq_setmask(oldmask);
+	return len - n;
+}
+
+void writechar(char c)
+{
+	uart_write(&c, 1);
 }
 
 void uart_async_init()
@@ -107,8 +228,15 @@ void uart_async_init()
 	rx_consume = 0;
 	tx_produce = 0;
 	tx_consume = 0;
-	tx_cts = 1;
 
+	/* Interrupt when the FIFOs are half full or half empty */
+	fifo_depth = CSR_UART_FIFODEPTH;
+	CSR_UART_RXTHRESHOLD = fifo_depth > 1 ? fifo_depth/2 : 1;
+	CSR_UART_TXTHRESHOLD = fifo_depth/2;
+
+	/* Received characters are lost when served late, sent ones are not */
+	irq_attach(IRQ_UARTRX, uart_async_isr_rx, 1);
+	irq_attach(IRQ_UARTTX, uart_async_isr_tx, 2);
 	irq_ack(IRQ_UARTRX|IRQ_UARTTX);
 
 	mask = irq_getmask();
@@ -118,6 +246,15 @@ void uart_async_init()
 
 void uart_force_sync(int f)
 {
-	if(f) while(!tx_cts);
+	unsigned int oldmask;
+
+	if(f) {
+		oldmask = irq_getmask();
+		irq_setmask(oldmask & (~IRQ_UARTTX));
+		while(tx_produce != tx_consume)
+			tx_fill();
+		while(CSR_UART_TXLEVEL != 0);
+		irq_setmask(oldmask);
+	}
 	force_sync = f;
 }
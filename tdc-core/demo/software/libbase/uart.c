@@ -16,35 +16,66 @@
  */
 
 #include <uart.h>
-#include <irq.h>
 #include <hw/uart.h>
-#include <hw/interrupts.h>
 
+/* Polled driver: the interrupt entry points are never used */
+
+void uart_async_init()
+{
+}
+
+void uart_async_isr_rx()
+{
+}
+
+void uart_async_isr_tx()
+{
+}
+
+/*
+ * The FIFO has room as long as TXLEVEL, which counts the character
+ * being sent, does not exceed its depth.
+ */
 void writechar(char c)
 {
+	while(CSR_UART_TXLEVEL > CSR_UART_FIFODEPTH);
 	CSR_UART_RXTX = c;
-	while(!(irq_pending() & IRQ_UARTTX));
-	irq_ack(IRQ_UARTTX);
+}
+
+void uart_write(const char *buf, int len)
+{
+	while(len-- > 0)
+		writechar(*buf++);
+}
+
+/* Returns the number of characters that did not fit in the FIFO */
+int uart_write_nonblock(const char *buf, int len)
+{
+	unsigned int depth;
+	int n;
+
+	depth = CSR_UART_FIFODEPTH;
+	for(n=0;(n < len) && (CSR_UART_TXLEVEL < depth);n++)
+		CSR_UART_RXTX = buf[n];
+	return len - n;
 }
 
 char readchar()
 {
 	char c;
 
-	while(!(irq_pending() & IRQ_UARTRX));
-	irq_ack(IRQ_UARTRX);
+	while(CSR_UART_RXLEVEL == 0);
 	c = CSR_UART_RXTX;
+	CSR_UART_RXLEVEL = 1;
 	return c;
 }
 
 int readchar_nonblock()
 {
-	if(irq_pending() & IRQ_UARTRX)
-		return 1;
-	else
-		return 0;
+	return CSR_UART_RXLEVEL != 0;
 }
 
 void uart_force_sync(int f)
 {
+	if(f) while(CSR_UART_TXLEVEL != 0);
 }
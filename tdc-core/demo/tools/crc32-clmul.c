@@ -0,0 +1,106 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CRC32 of large buffers on x86 hosts with carry-less multiplication
+ * (PCLMULQDQ), after "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction" (Intel, 2009): four 128-bit lanes are folded
+ * 64 bytes at a time, then into one lane, and Barrett-reduced to 32 bits.
+ * Used by software/libbase/crc32.c when built with CRC32_CLMUL.
+ */
+
+#include <immintrin.h>
+
+int crc32_clmul_supported()
+{
+	static int supported = -1;
+
+	if(supported < 0) {
+		__builtin_cpu_init();
+		supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+	}
+	return supported;
+}
+
+/* Constants of the bit-reflected domain, for the polynomial 0x04c11db7 */
+static const unsigned long long __attribute__((aligned(16))) k1k2[2] = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+static const unsigned long long __attribute__((aligned(16))) k3k4[2] = { 0x01751997d0ULL, 0x00ccaa009eULL };
+static const unsigned long long __attribute__((aligned(16))) k5k0[2] = { 0x0163cd6124ULL, 0x0000000000ULL };
+static const unsigned long long __attribute__((aligned(16))) poly[2] = { 0x01db710641ULL, 0x01f7011641ULL };
+
+#define FOLD(x, k, y) \
+	_mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), y)
+
+/*
+ * Works on the inverted CRC register, like the update functions of
+ * crc32.c. len must be a multiple of 16, and at least 64.
+ */
+__attribute__((target("pclmul,sse4.1")))
+unsigned int crc32_clmul(unsigned int crc, const unsigned char *buffer, unsigned int len)
+{
+	__m128i x0, x1, x2, x3, x4;
+	__m128i mask;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buffer + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buffer + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buffer + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buffer + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	buffer += 64;
+	len -= 64;
+
+	/* Fold 64 bytes at a time into the four lanes */
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	while(len >= 64) {
+		x1 = FOLD(x1, x0, _mm_loadu_si128((const __m128i *)(buffer + 0x00)));
+		x2 = FOLD(x2, x0, _mm_loadu_si128((const __m128i *)(buffer + 0x10)));
+		x3 = FOLD(x3, x0, _mm_loadu_si128((const __m128i *)(buffer + 0x20)));
+		x4 = FOLD(x4, x0, _mm_loadu_si128((const __m128i *)(buffer + 0x30)));
+		buffer += 64;
+		len -= 64;
+	}
+
+	/* Fold the lanes into one, then the remaining 16-byte blocks */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	x1 = FOLD(x1, x0, x2);
+	x1 = FOLD(x1, x0, x3);
+	x1 = FOLD(x1, x0, x4);
+	while(len >= 16) {
+		x1 = FOLD(x1, x0, _mm_loadu_si128((const __m128i *)buffer));
+		buffer += 16;
+		len -= 16;
+	}
+
+	/* 128 bits to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, mask);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, mask);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
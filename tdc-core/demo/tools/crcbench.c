@@ -0,0 +1,212 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the CRC kernels of libbase against the byte-at-a-time loops and
+ * measures them on the host. The shared sources are included here to get
+ * at each kernel. On the target, the "crc" command of a BIOS built with
+ * BENCH=1 reports cycles per KB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../software/libbase/crc16.c"
+#include "../software/libbase/crc32.c"
+
+#define BENCH_LENGTH	(4*1024*1024)
+#define BENCH_RUNS	16
+#define CHECK_LENGTH	300
+
+#if defined(__x86_64__) || defined(__i386__)
+#define UNIT "cycle"
+static unsigned long long ticks()
+{
+	return __rdtsc();
+}
+#else
+#define UNIT "ns"
+static unsigned long long ticks()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+typedef unsigned int (*crc32_kernel)(unsigned int, const unsigned char *, unsigned int);
+typedef unsigned short (*crc16_kernel)(unsigned short, const unsigned char *, int);
+
+#ifdef CRC32_CLMUL
+/* As in crc32_update(), the tail goes through slicing */
+static unsigned int crc32_clmul_tail(unsigned int crc, const unsigned char *buffer, unsigned int len)
+{
+	unsigned int n;
+
+	n = len & ~15;
+	if(n >= 64) {
+		crc = crc32_clmul(crc, buffer, n);
+		buffer += n;
+		len -= n;
+	}
+	return crc32_bytes(crc, buffer, len);
+}
+#endif
+
+static const struct {
+	const char *name;
+	crc32_kernel kernel;
+} crc32_kernels[] = {
+	{ "crc32 bytes", crc32_bytes },
+	{ "crc32 by4", crc32_by4 },
+#if CRC32_SLICES >= 8
+	{ "crc32 by8", crc32_by8 },
+#endif
+#ifdef CRC32_CLMUL
+	{ "crc32 clmul", crc32_clmul_tail },
+#endif
+};
+
+static const struct {
+	const char *name;
+	crc16_kernel kernel;
+} crc16_kernels[] = {
+	{ "crc16 bytes", crc16_bytes },
+	{ "crc16 by4", crc16_by4 },
+#if CRC16_SLICES >= 8
+	{ "crc16 by8", crc16_by8 },
+#endif
+};
+
+#define NKERNELS(k) ((int)(sizeof(k)/sizeof(k[0])))
+
+static int usable(const char *name)
+{
+#ifdef CRC32_CLMUL
+	if((strcmp(name, "crc32 clmul") == 0) && !crc32_clmul_supported())
+		return 0;
+#endif
+	return 1;
+}
+
+/* Every kernel must agree with the byte loop for all lengths and alignments */
+static int check(const unsigned char *data)
+{
+	unsigned int offset, length;
+	unsigned int ref32;
+	unsigned short ref16;
+	int errors;
+	int i;
+
+	errors = 0;
+	for(offset=0;offset<8;offset++)
+		for(length=0;length<=CHECK_LENGTH;length++) {
+			ref32 = crc32_bytes(0xffffffff, data + offset, length);
+			for(i=1;i<NKERNELS(crc32_kernels);i++) {
+				if(!usable(crc32_kernels[i].name)) continue;
+				if(crc32_kernels[i].kernel(0xffffffff, data + offset, length) != ref32) {
+					fprintf(stderr, "%s: mismatch at offset %u, length %u\n",
+						crc32_kernels[i].name, offset, length);
+					errors++;
+				}
+			}
+			if(crc32(data + offset, length) != (ref32 ^ 0xffffffff)) {
+				fprintf(stderr, "crc32(): mismatch at offset %u, length %u\n", offset, length);
+				errors++;
+			}
+			ref16 = crc16_bytes(0, data + offset, length);
+			for(i=1;i<NKERNELS(crc16_kernels);i++)
+				if(crc16_kernels[i].kernel(0, data + offset, length) != ref16) {
+					fprintf(stderr, "%s: mismatch at offset %u, length %u\n",
+						crc16_kernels[i].name, offset, length);
+					errors++;
+				}
+			if(crc16(data + offset, length) != ref16) {
+				fprintf(stderr, "crc16(): mismatch at offset %u, length %u\n", offset, length);
+				errors++;
+			}
+		}
+	/* Known answer: CRC32 and CRC16 (XMODEM) of "123456789" */
+	if(crc32((const unsigned char *)"123456789", 9) != 0xcbf43926) {
+		fprintf(stderr, "crc32(): wrong check value\n");
+		errors++;
+	}
+	if(crc16((const unsigned char *)"123456789", 9) != 0x31c3) {
+		fprintf(stderr, "crc16(): wrong check value\n");
+		errors++;
+	}
+	return errors;
+}
+
+static void report(const char *name, unsigned long long best)
+{
+	printf("%-12s %8.3f bytes/%s\n", name, (double)BENCH_LENGTH/best, UNIT);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char *data;
+	unsigned long long t, best;
+	volatile unsigned int sink;
+	int i, j;
+
+	data = malloc(BENCH_LENGTH + 8);
+	if(data == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	srand48(1);
+	for(i=0;i<BENCH_LENGTH+8;i++)
+		data[i] = lrand48();
+
+	if(check(data) != 0)
+		return 1;
+	printf("All kernels agree.\n");
+	if((argc > 1) && (strcmp(argv[1], "--check") == 0))
+		return 0;
+
+	/* Best of several runs over a buffer larger than the caches */
+	for(i=0;i<NKERNELS(crc32_kernels);i++) {
+		if(!usable(crc32_kernels[i].name)) continue;
+		best = ~0ULL;
+		for(j=0;j<BENCH_RUNS;j++) {
+			t = ticks();
+			sink = crc32_kernels[i].kernel(0xffffffff, data, BENCH_LENGTH);
+			t = ticks() - t;
+			if(t < best) best = t;
+		}
+		report(crc32_kernels[i].name, best);
+	}
+	for(i=0;i<NKERNELS(crc16_kernels);i++) {
+		best = ~0ULL;
+		for(j=0;j<BENCH_RUNS;j++) {
+			t = ticks();
+			sink = crc16_kernels[i].kernel(0, data, BENCH_LENGTH);
+			t = ticks() - t;
+			if(t < best) best = t;
+		}
+		report(crc16_kernels[i].name, best);
+	}
+	(void)sink;
+	free(data);
+	return 0;
+}
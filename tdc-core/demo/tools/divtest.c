@@ -0,0 +1,142 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the firmware division routines and 64-bit helpers against the
+ * host arithmetic, on edge cases and random operands of every size.
+ * The cycle counts on the LM32 are given by the BIOS divbench and
+ * llbench commands.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <divide.h>
+#include <libgcc_lm32.h>
+
+static int errors;
+
+static void check(unsigned int num, unsigned int den)
+{
+	struct udiv_const d;
+	unsigned int q, r;
+
+	q = udivmod(num, den, &r);
+	if((q != num/den) || (r != num%den)) {
+		if(errors++ < 10)
+			printf("FAIL udivmod %u/%u: %u rem %u\n", num, den, q, r);
+	}
+	udiv_const_init(&d, den);
+	q = udiv_const(&d, num, &r);
+	if((q != num/den) || (r != num%den)) {
+		if(errors++ < 10)
+			printf("FAIL udiv_const %u/%u: %u rem %u\n", num, den, q, r);
+	}
+	if(udivmod(num, den, NULL) != num/den) {
+		if(errors++ < 10)
+			printf("FAIL udivmod %u/%u without remainder\n", num, den);
+	}
+}
+
+static void check64(unsigned long long a, unsigned long long b, int n)
+{
+	unsigned long long q, r;
+
+	if(b != 0) {
+		q = udivmod64(a, b, &r);
+		if((q != a/b) || (r != a%b)) {
+			if(errors++ < 10)
+				printf("FAIL udivmod64 %llu/%llu: %llu rem %llu\n", a, b, q, r);
+		}
+	}
+	if((unsigned long long)__muldi3(a, b) != a*b) {
+		if(errors++ < 10)
+			printf("FAIL __muldi3 %llx*%llx\n", a, b);
+	}
+	n &= 63;
+	if(((unsigned long long)__ashldi3(a, n) != a << n)
+	  || (__lshrdi3(a, n) != a >> n)
+	  || (__ashrdi3(a, n) != (long long)a >> n)) {
+		if(errors++ < 10)
+			printf("FAIL shifts %llx by %d\n", a, n);
+	}
+}
+
+/* Random value of a random width */
+static unsigned int random_word()
+{
+	unsigned int v;
+
+	v = ((unsigned int)random() << 16) ^ (unsigned int)random();
+	return v >> (random() % 32);
+}
+
+static unsigned long long random_dword()
+{
+	unsigned long long v;
+
+	v = ((unsigned long long)random_word() << 32) | random_word();
+	return v >> (random() % 64);
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int edges[] = {
+		1, 2, 3, 5, 7, 9, 10, 11, 15, 16, 17, 100, 125, 255, 256, 1000,
+		0x7fff, 0x8000, 0xffff, 0x10000, 0x12345, 0x7fffffff,
+		0x80000000, 0x80000001, 0xfffffffe, 0xffffffff
+	};
+	int nedges = sizeof(edges)/sizeof(edges[0]);
+	unsigned int num;
+	unsigned long long a, b;
+	int i, j;
+
+	srandom(1);
+	for(i=0;i<nedges;i++)
+		for(j=0;j<nedges;j++) {
+			check(edges[i], edges[j]);
+			check(edges[i] - 1, edges[j]);
+			check(edges[i] + 1, edges[j]);
+		}
+	/* Division by 10 has its own path */
+	for(num=0;num<0x1000000;num++)
+		check(num, 10);
+	for(num=0xffffffff;num>=0xff000000;num--)
+		check(num, 10);
+	for(i=0;i<2000000;i++) {
+		j = random_word();
+		check(random_word(), j ? j : 1);
+	}
+
+	for(i=0;i<nedges;i++)
+		for(j=0;j<nedges;j++) {
+			a = edges[i];
+			b = edges[j];
+			check64(a, b, i + j);
+			check64(a << 32, b, i);
+			check64((a << 32) | b, b, j);
+			check64((a << 32) | b, (b << 32) | a, i - j);
+			check64(a * b, b - 1, j + 32);
+		}
+	for(i=0;i<2000000;i++)
+		check64(random_dword(), random_dword(), random());
+
+	if(errors) {
+		printf("%d errors\n", errors);
+		return 1;
+	}
+	printf("Division routines agree.\n");
+	return 0;
+}
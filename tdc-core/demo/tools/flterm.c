@@ -27,68 +27,91 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <poll.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <crc.h>
 #include <sfl.h>
+#include <lz4.h>
+#include <serial.h>
 
 #define DEFAULT_KERNELADR	(0x40000000)
 #define DEFAULT_CMDLINEADR	(0x41000000)
 #define DEFAULT_INITRDADR	(0x41002000)
 
-unsigned int crc16_table[256] = {
-	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
-	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
-	0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
-	0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
-	0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
-	0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
-	0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
-	0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
-	0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
-	0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
-	0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
-	0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
-	0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
-	0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
-	0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
-	0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
-	0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
-	0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
-	0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
-	0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
-	0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
-	0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
-	0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
-	0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
-	0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
-	0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
-	0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
-	0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
-	0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
-	0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
-	0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
-	0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
-};
+#define DEFAULT_WINDOW		8
 
-static unsigned short crc16(const void *_buffer, int len)
-{
-	const unsigned char *buffer = (const unsigned char *)_buffer;
-	unsigned short crc;
-	
-	crc = 0;
-	while(len-- > 0)
-	    crc = crc16_table[((crc >> 8) ^ (*buffer++)) & 0xFF] ^ (crc << 8);
-	
-	return crc;
-}
+/* Time to wait for a reply in windowed mode before retransmitting, in ms */
+#define REPLY_TIMEOUT		1000
+
+/* Windowed sessions start with MIN_PAYLOAD bytes per frame. The payload
+ * doubles once data for GROW_FRAMES frames of the doubled size has been
+ * acknowledged without errors, so that large frames are only used on
+ * lines that rarely damage them, and halves after each CRC error.
+ */
+#define MIN_PAYLOAD		(256+4)
+#define GROW_FRAMES		16
+
+/* Data handed to the compressor at once, in frame payloads */
+#define COMPRESS_FRAMES		4
+
+/* Granularity of delta uploads */
+#define DELTA_BLOCK		4096
+
+/* Shortest run of identical bytes sent as a fill */
+#define FILL_MIN		64
+
+/* Baud rate changes: the host sends the confirmation string up to
+ * BAUD_ATTEMPTS times, waiting BAUD_CONFIRM_TIMEOUT ms for the echo each
+ * time. On failure, it waits BAUD_FALLBACK_DELAY ms for the device to
+ * go back to the previous rate.
+ */
+#define BAUD_ATTEMPTS		3
+#define BAUD_CONFIRM_TIMEOUT	100
+#define BAUD_FALLBACK_DELAY	1500
+
+/* Multi-port mode: seconds to wait for each download request, and
+ * number of new requests accepted after a failed session.
+ */
+#define DEFAULT_WAIT		60
+#define DEFAULT_RETRIES		2
+
+/* Size of the terminal buffers, in each direction */
+#define TERM_BUFFER		4096
 
+/* Memory dumps: number of requests for each chunk before giving up,
+ * time without data after which a request is considered failed (ms),
+ * and quiet time waiting for the end of a broken stream (ms).
+ */
+#define DUMP_PASSES		4
+#define DUMP_TIMEOUT		2000
+#define DUMP_DRAIN		300
+
+/* Batch mode: attempts at getting a reply to each packet, reply timeout
+ * and time to wait for the rest of a damaged reply (ms)
+ */
+#define BATCH_ATTEMPTS		8
+#define BATCH_TIMEOUT		3000
+#define BATCH_DRAIN		300
+
+/* Also works on non-blocking descriptors */
 static int write_exact(int fd, const char *data, unsigned int length)
 {
+	struct pollfd pfd;
 	int r;
 	
 	while(length > 0) {
 		r = write(fd, data, length);
+		if((r < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, -1);
+			continue;
+		}
 		if(r <= 0) return 0;
 		length -= r;
 		data += r;
@@ -96,280 +119,2308 @@ static int write_exact(int fd, const char *data, unsigned int length)
 	return 1;
 }
 
-/* length, cmd and payload must be filled in */
-static int send_frame(int serialfd, struct sfl_frame *frame)
+/* Number of consecutive reply timeouts after which we give up */
+#define MAX_TIMEOUTS		10
+
+/* Returns 1 on success, 0 on timeout and -1 on error */
+static int read_timeout(int fd, unsigned char *data, unsigned int length, int timeout)
+{
+	struct pollfd pfd;
+	int r;
+
+	while(length > 0) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		r = poll(&pfd, 1, timeout);
+		if(r < 0) return -1;
+		if(r == 0) return 0;
+		r = read(fd, data, length);
+		if((r < 0) && ((errno == EAGAIN) || (errno == EINTR))) continue;
+		if(r <= 0) return -1;
+		length -= r;
+		data += r;
+	}
+	return 1;
+}
+
+struct sfl_request {
+	struct sfl_frame frame;
+	/* Where to store the data of a SFL_ACK_DATA reply */
+	unsigned char *reply;
+	int reply_length;
+	int done;
+	/* Time of the last transmission */
+	struct timeval sent;
+	/* Image data carried by a LOAD frame, to split the frame if it has
+	 * to be sent again with a smaller payload
+	 */
+	const unsigned char *data;
+	int data_length;
+	unsigned int address;
+};
+
+/* Image data of a split frame that remains to be sent */
+struct sfl_split {
+	const unsigned char *data;
+	int length;
+	unsigned int address;
+};
+
+/* Link statistics, possibly over several sessions */
+struct sfl_stats {
+	struct timeval start;
+	int sessions;
+	int frames;
+	int retransmissions;
+	int crc_errors;
+	int timeouts;
+	int error_replies;
+	int unknown_replies;
+	/* Everything written to the port, and the memory loaded with it */
+	long long wire_bytes;
+	long long payload_bytes;
+	/* Round-trip times of the acknowledged frames, in microseconds */
+	int *rtt;
+	int rtt_count;
+	int rtt_size;
+};
+
+static void init_stats(struct sfl_stats *st)
+{
+	memset(st, 0, sizeof(struct sfl_stats));
+	gettimeofday(&st->start, NULL);
+}
+
+static void free_stats(struct sfl_stats *st)
+{
+	free(st->rtt);
+	st->rtt = NULL;
+}
+
+static void record_rtt(struct sfl_stats *st, const struct timeval *sent)
+{
+	struct timeval now;
+	int *rtt;
+
+	if(st->rtt_count == st->rtt_size) {
+		rtt = realloc(st->rtt, (st->rtt_size + 1024)*sizeof(int));
+		if(rtt == NULL) return;
+		st->rtt = rtt;
+		st->rtt_size += 1024;
+	}
+	gettimeofday(&now, NULL);
+	st->rtt[st->rtt_count++] = (now.tv_sec - sent->tv_sec)*1000000 + (now.tv_usec - sent->tv_usec);
+}
+
+static int compare_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Nearest-rank percentile of sorted values */
+static int percentile(const int *sorted, int count, int pct)
+{
+	int rank;
+
+	rank = (count*pct + 99)/100;
+	if(rank < 1) rank = 1;
+	return sorted[rank-1];
+}
+
+/* Returns a sorted copy of the round-trip times, or NULL if there are none */
+static int *sort_rtt(const struct sfl_stats *st)
+{
+	int *sorted;
+
+	if(st->rtt_count == 0) return NULL;
+	sorted = malloc(st->rtt_count*sizeof(int));
+	if(sorted == NULL) return NULL;
+	memcpy(sorted, st->rtt, st->rtt_count*sizeof(int));
+	qsort(sorted, st->rtt_count, sizeof(int), compare_int);
+	return sorted;
+}
+
+static void print_json_string(FILE *f, const char *str)
 {
+	fputc('"', f);
+	for(;*str;str++) {
+		if((*str == '"') || (*str == '\\'))
+			fputc('\\', f);
+		if((unsigned char)*str >= 0x20)
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+static void print_stats_json(FILE *f, const char *port, int booted, int baudrate,
+	const struct sfl_stats *st)
+{
+	struct timeval now;
+	double elapsed;
+	int *sorted;
+	long long total;
+	int bucket;
+	int count;
+	int i;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - st->start.tv_sec) + (now.tv_usec - st->start.tv_usec)/1000000.0;
+	if(elapsed <= 0.0) elapsed = 1e-6;
+
+	fprintf(f, "{\n");
+	if(port != NULL) {
+		fprintf(f, "\t\"port\": ");
+		print_json_string(f, port);
+		fprintf(f, ",\n");
+	}
+	fprintf(f, "\t\"booted\": %s,\n", booted ? "true" : "false");
+	fprintf(f, "\t\"baudrate\": %d,\n", baudrate);
+	fprintf(f, "\t\"sessions\": %d,\n", st->sessions);
+	fprintf(f, "\t\"elapsed_s\": %.3f,\n", elapsed);
+	fprintf(f, "\t\"frames\": %d,\n", st->frames);
+	fprintf(f, "\t\"retransmissions\": %d,\n", st->retransmissions);
+	fprintf(f, "\t\"crc_errors\": %d,\n", st->crc_errors);
+	fprintf(f, "\t\"timeouts\": %d,\n", st->timeouts);
+	fprintf(f, "\t\"error_replies\": %d,\n", st->error_replies);
+	fprintf(f, "\t\"unknown_replies\": %d,\n", st->unknown_replies);
+	fprintf(f, "\t\"wire_bytes\": %lld,\n", st->wire_bytes);
+	fprintf(f, "\t\"payload_bytes\": %lld,\n", st->payload_bytes);
+	fprintf(f, "\t\"payload_per_wire_byte\": %.3f,\n",
+		st->wire_bytes > 0 ? (double)st->payload_bytes/st->wire_bytes : 0.0);
+	fprintf(f, "\t\"payload_bytes_per_s\": %.0f,\n", st->payload_bytes/elapsed);
+	fprintf(f, "\t\"rtt_us\": {\n");
+	fprintf(f, "\t\t\"count\": %d", st->rtt_count);
+	sorted = sort_rtt(st);
+	if(sorted != NULL) {
+		total = 0;
+		for(i=0;i<st->rtt_count;i++)
+			total += sorted[i];
+		fprintf(f, ",\n\t\t\"min\": %d,\n", sorted[0]);
+		fprintf(f, "\t\t\"mean\": %.0f,\n", (double)total/st->rtt_count);
+		fprintf(f, "\t\t\"p50\": %d,\n", percentile(sorted, st->rtt_count, 50));
+		fprintf(f, "\t\t\"p90\": %d,\n", percentile(sorted, st->rtt_count, 90));
+		fprintf(f, "\t\t\"p99\": %d,\n", percentile(sorted, st->rtt_count, 99));
+		fprintf(f, "\t\t\"max\": %d,\n", sorted[st->rtt_count-1]);
+		/* Power of two buckets, up to the one holding the maximum */
+		fprintf(f, "\t\t\"histogram\": [");
+		i = 0;
+		for(bucket=1;;bucket*=2) {
+			count = 0;
+			while((i < st->rtt_count) && (sorted[i] <= bucket)) {
+				count++;
+				i++;
+			}
+			fprintf(f, "%s\n\t\t\t{\"le\": %d, \"count\": %d}", bucket == 1 ? "" : ",", bucket, count);
+			if(i == st->rtt_count) break;
+		}
+		fprintf(f, "\n\t\t]");
+		free(sorted);
+	}
+	fprintf(f, "\n\t}\n");
+	fprintf(f, "}");
+}
+
+/* "-" is the standard output */
+static FILE *open_stats_json(const char *filename)
+{
+	FILE *f;
+
+	if(strcmp(filename, "-") == 0)
+		return stdout;
+	f = fopen(filename, "w");
+	if(f == NULL)
+		fprintf(stderr, "[FLTERM] Unable to create %s: %s\n", filename, strerror(errno));
+	return f;
+}
+
+static void close_stats_json(FILE *f)
+{
+	fprintf(f, "\n");
+	if(f != stdout)
+		fclose(f);
+	else
+		fflush(f);
+}
+
+struct sfl_session {
+	int fd;
+	int baudrate;
+	int features;
+	int window;
+	int max_payload;
+	/* Payload of new frames, and bytes acknowledged since the last
+	 * CRC error
+	 */
+	int payload;
+	int clean;
+	int timeout;
+	unsigned char next_seq;
+	/* Frames sent but not yet acknowledged, oldest at head */
+	int head;
+	int count;
+	/* No new frames between SFL_ACK_HOLD and SFL_ACK_CRCERROR */
+	int held;
+	struct sfl_request inflight[SFL_WINDOW_MAX];
+	struct sfl_split splits[SFL_WINDOW_MAX];
+	int nsplits;
+	/* Port name for messages, NULL with a single port */
+	const char *port;
+	/* Percentage of the current image sent */
+	volatile int progress;
+	struct sfl_stats *stats;
+};
+
+static void init_session(struct sfl_session *s, int fd, int baudrate, const char *port,
+	struct sfl_stats *stats)
+{
+	s->fd = fd;
+	s->baudrate = baudrate;
+	s->port = port;
+	s->progress = 0;
+	s->stats = stats;
+	stats->sessions++;
+}
+
+static void session_printf(struct sfl_session *s, FILE *f, const char *fmt, ...)
+{
+	va_list args;
+	char msg[256];
+
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+	if(s->port != NULL)
+		fprintf(f, "[FLTERM %s] %s", s->port, msg);
+	else
+		fprintf(f, "[FLTERM] %s", msg);
+}
+
+static void session_perror(struct sfl_session *s, const char *msg)
+{
+	session_printf(s, stderr, "%s: %s\n", msg, strerror(errno));
+}
+
+static void print_stats(struct sfl_session *s)
+{
+	const struct sfl_stats *st = s->stats;
+	int *sorted;
+
+	session_printf(s, stdout, "%d frames, %d retransmitted (%d CRC errors, %d timeouts), "
+		"%lld bytes on the wire for %lld bytes loaded.\n",
+		st->frames, st->retransmissions, st->crc_errors, st->timeouts,
+		st->wire_bytes, st->payload_bytes);
+	sorted = sort_rtt(st);
+	if(sorted != NULL) {
+		session_printf(s, stdout, "Round trip: median %.1fms, 90%% %.1fms, 99%% %.1fms, max %.1fms.\n",
+			percentile(sorted, st->rtt_count, 50)/1000.0,
+			percentile(sorted, st->rtt_count, 90)/1000.0,
+			percentile(sorted, st->rtt_count, 99)/1000.0,
+			sorted[st->rtt_count-1]/1000.0);
+		free(sorted);
+	}
+}
+
+/* length, seq, cmd and payload must be filled in */
+static void seal_frame(struct sfl_session *s, struct sfl_frame *frame)
+{
+	unsigned char header[4+SFL_HEADER_PAYLOAD];
 	unsigned short int crc;
-	int retry;
-	char reply;
-	
-	crc = crc16(&frame->cmd, frame->length+1);
+	int n;
+
+	if(s->features & SFL_FEATURE_WINDOW) {
+		crc = crc16(&frame->seq, frame->length+2);
+		n = frame->length < SFL_HEADER_PAYLOAD ? frame->length : SFL_HEADER_PAYLOAD;
+		header[0] = (frame->length & 0xff00) >> 8;
+		header[1] = frame->length & 0x00ff;
+		header[2] = frame->seq;
+		header[3] = frame->cmd;
+		memcpy(&header[4], frame->payload, n);
+		n = crc16(header, 4+n);
+		frame->hcrc[0] = (n & 0xff00) >> 8;
+		frame->hcrc[1] = (n & 0x00ff);
+	} else
+		crc = crc16(&frame->cmd, frame->length+1);
 	frame->crc[0] = (crc & 0xff00) >> 8;
 	frame->crc[1] = (crc & 0x00ff);
-	
-	retry = 0;
-	do {
-		if(!write_exact(serialfd, (char *)frame, frame->length+4)) {
-			perror("[FLTERM] Unable to write to serial port.");
+}
+
+static int write_frame(struct sfl_session *s, const struct sfl_frame *frame)
+{
+	unsigned char wire[sizeof(struct sfl_frame)+1];
+	int n;
+
+	n = 0;
+	if(s->features & SFL_FEATURE_LARGE)
+		wire[n++] = (frame->length & 0xff00) >> 8;
+	wire[n++] = frame->length & 0x00ff;
+	if(s->features & SFL_FEATURE_WINDOW) {
+		wire[n++] = frame->hcrc[0];
+		wire[n++] = frame->hcrc[1];
+	}
+	wire[n++] = frame->crc[0];
+	wire[n++] = frame->crc[1];
+	if(s->features & SFL_FEATURE_WINDOW)
+		wire[n++] = frame->seq;
+	wire[n++] = frame->cmd;
+	memcpy(&wire[n], frame->payload, frame->length);
+	n += frame->length;
+	if(!write_exact(s->fd, (char *)wire, n)) {
+		session_perror(s, "Unable to write to serial port.");
+		return 0;
+	}
+	s->stats->wire_bytes += n;
+	return 1;
+}
+
+/* Fills in a frame that loads the beginning of data at the given address,
+ * compressed if that makes it smaller.
+ * Returns the number of bytes of data the frame carries.
+ */
+static int build_load(struct sfl_session *s, struct sfl_frame *frame,
+	const unsigned char *data, int length, unsigned int address)
+{
+	int max;
+	int chunk;
+	int clen;
+
+	max = s->payload - 4;
+	if(s->features & SFL_FEATURE_COMPRESS) {
+		chunk = COMPRESS_FRAMES*max;
+		if(chunk > length) chunk = length;
+		while(1) {
+			clen = lz4_compress(data, chunk, &frame->payload[8], s->payload - 8);
+			if((clen > 0) && ((chunk > max) || (clen + 4 < chunk))) {
+				frame->length = clen+8;
+				frame->cmd = SFL_CMD_LOAD_COMPRESSED;
+				frame->payload[0] = (address & 0xff000000) >> 24;
+				frame->payload[1] = (address & 0x00ff0000) >> 16;
+				frame->payload[2] = (address & 0x0000ff00) >> 8;
+				frame->payload[3] = (address & 0x000000ff);
+				frame->payload[4] = (chunk & 0xff000000) >> 24;
+				frame->payload[5] = (chunk & 0x00ff0000) >> 16;
+				frame->payload[6] = (chunk & 0x0000ff00) >> 8;
+				frame->payload[7] = (chunk & 0x000000ff);
+				return chunk;
+			}
+			if(chunk <= max) break;
+			chunk /= 2;
+		}
+	}
+
+	chunk = length < max ? length : max;
+	frame->length = chunk+4;
+	frame->cmd = SFL_CMD_LOAD;
+	frame->payload[0] = (address & 0xff000000) >> 24;
+	frame->payload[1] = (address & 0x00ff0000) >> 16;
+	frame->payload[2] = (address & 0x0000ff00) >> 8;
+	frame->payload[3] = (address & 0x000000ff);
+	memcpy(&frame->payload[4], data, chunk);
+	return chunk;
+}
+
+/* Sends a frame again. A LOAD frame larger than the current payload is
+ * cut down to it, and the rest of its data is sent later in new frames.
+ */
+static int resend(struct sfl_session *s, struct sfl_request *r)
+{
+	struct sfl_split *split;
+	int n;
+
+	if((r->data != NULL) && (r->frame.length > s->payload)
+	  && (s->nsplits < SFL_WINDOW_MAX)) {
+		n = build_load(s, &r->frame, r->data, r->data_length, r->address);
+		seal_frame(s, &r->frame);
+		if(n < r->data_length) {
+			split = &s->splits[s->nsplits++];
+			split->data = r->data + n;
+			split->length = r->data_length - n;
+			split->address = r->address + n;
+			r->data_length = n;
+		}
+	}
+	if(!write_frame(s, &r->frame))
+		return 0;
+	gettimeofday(&r->sent, NULL);
+	s->stats->retransmissions++;
+	return 1;
+}
+
+static int retransmit(struct sfl_session *s)
+{
+	struct sfl_request *r;
+	int i;
+
+	for(i=0;i<s->count;i++) {
+		r = &s->inflight[(s->head+i) % SFL_WINDOW_MAX];
+		if(r->done) continue;
+		if(!resend(s, r))
+			return 0;
+	}
+	return 1;
+}
+
+/* Smaller frames for a while, after a damaged one */
+static void shrink_payload(struct sfl_session *s)
+{
+	s->stats->crc_errors++;
+	s->payload /= 2;
+	if(s->payload < MIN_PAYLOAD)
+		s->payload = MIN_PAYLOAD;
+	if(s->payload > s->max_payload)
+		s->payload = s->max_payload;
+	s->clean = 0;
+}
+
+/* Reads the length, CRC and data following SFL_ACK_DATA into r,
+ * or discards them if r is NULL.
+ * Returns 1 if the data is good, 0 if it is damaged and -1 on error.
+ */
+static int read_data_reply(struct sfl_session *s, struct sfl_request *r)
+{
+	unsigned char header[4];
+	unsigned char data[SFL_PAYLOAD_MAX];
+	int length;
+
+	if(read_timeout(s->fd, header, 4, s->timeout) <= 0) return -1;
+	length = ((int)header[0] << 8)|(int)header[1];
+	if(length > sizeof(data)) return -1;
+	if(read_timeout(s->fd, data, length, s->timeout) <= 0) return -1;
+	if(crc16(data, length) != (((int)header[2] << 8)|(int)header[3]))
+		return 0;
+	if(r != NULL) {
+		if((r->reply == NULL) || (length != r->reply_length)) return -1;
+		memcpy(r->reply, data, length);
+	}
+	return 1;
+}
+
+/* Waits for one reply from the device and retires the acknowledged frames */
+static int wait_reply(struct sfl_session *s)
+{
+	int windowed;
+	unsigned char reply[2];
+	struct sfl_request *r;
+	struct sfl_request *older;
+	int timeouts;
+	int ret;
+	int index;
+	int i;
+
+	windowed = s->features & SFL_FEATURE_WINDOW;
+	timeouts = 0;
+	while(1) {
+		/* Without sequence numbers, a late reply cannot be told
+		 * apart from the reply to a retransmitted frame, so
+		 * classic mode never times out.
+		 */
+		ret = read_timeout(s->fd, reply, windowed ? 2 : 1, windowed ? s->timeout : -1);
+		if(ret < 0) {
+			session_perror(s, "Unable to read from serial port.");
 			return 0;
 		}
-		/* Get the reply from the device */
-		read(serialfd, &reply, 1); /* TODO: timeout */
-		switch(reply) {
-			case SFL_ACK_SUCCESS:
-				retry = 0;
-				break;
-			case SFL_ACK_CRCERROR:
-				retry = 1;
-				break;
-			default:
-				fprintf(stderr, "[FLTERM] Got unknown reply '%c' from the device, aborting.\n", reply);
-				return 0;
+		if(ret > 0) break;
+		timeouts++;
+		s->stats->timeouts++;
+		if(timeouts == MAX_TIMEOUTS) {
+			session_printf(s, stderr, "No reply from the device, aborting.\n");
+			return 0;
+		}
+		s->held = 0;
+		if(!retransmit(s)) return 0;
+	}
+	if(!windowed)
+		reply[1] = s->inflight[s->head].frame.seq;
+
+	/* Replies outside the window refer to frames that have been
+	 * retransmitted and are ignored.
+	 */
+	index = (unsigned char)(reply[1] - s->inflight[s->head].frame.seq);
+	r = index < s->count ? &s->inflight[(s->head+index) % SFL_WINDOW_MAX] : NULL;
+
+	switch(reply[0]) {
+		case SFL_ACK_SUCCESS:
+		case SFL_ACK_DATA:
+			if(reply[0] == SFL_ACK_DATA) {
+				ret = read_data_reply(s, r);
+				if(ret < 0) {
+					session_printf(s, stderr, "Got malformed data from the device, aborting.\n");
+					return 0;
+				}
+			} else
+				ret = 1;
+			if(r == NULL) break;
+			/* Without SFL_FEATURE_SELECTIVE, the device processes
+			 * frames in order, so a reply also acknowledges all
+			 * older frames. Frames waiting for data are
+			 * retransmitted until their data gets through.
+			 */
+			for(i=0;i<index && !(s->features & SFL_FEATURE_SELECTIVE);i++) {
+				older = &s->inflight[(s->head+i) % SFL_WINDOW_MAX];
+				if((older->reply == NULL) && !older->done) {
+					older->done = 1;
+					record_rtt(s->stats, &older->sent);
+				}
+			}
+			if(ret && !r->done) {
+				r->done = 1;
+				record_rtt(s->stats, &r->sent);
+			}
+			while((s->count > 0) && s->inflight[s->head].done) {
+				s->clean += s->inflight[s->head].frame.length;
+				s->head = (s->head + 1) % SFL_WINDOW_MAX;
+				s->count--;
+			}
+			if((s->clean >= GROW_FRAMES*2*s->payload) && (s->payload < s->max_payload)) {
+				s->payload *= 2;
+				if(s->payload > s->max_payload)
+					s->payload = s->max_payload;
+				s->clean = 0;
+			}
+			break;
+		case SFL_ACK_HOLD:
+			/* The device discards everything up to the line
+			 * going quiet, so what has not been sent yet
+			 * would only delay the retransmission.
+			 */
+			s->held = 1;
+			tcflush(s->fd, TCOFLUSH);
+			break;
+		case SFL_ACK_CRCERROR:
+			/* The device has discarded everything after the
+			 * damaged frame.
+			 */
+			s->held = 0;
+			shrink_payload(s);
+			if(!retransmit(s)) return 0;
+			break;
+		case SFL_ACK_RESEND:
+			/* Only this frame was lost */
+			if((r == NULL) || r->done) break;
+			shrink_payload(s);
+			if(!resend(s, r)) return 0;
+			break;
+		case SFL_ACK_ERROR:
+			s->stats->error_replies++;
+			session_printf(s, stderr, "Device could not execute command 0x%02x, aborting.\n",
+				r != NULL ? r->frame.cmd : 0);
+			return 0;
+		default:
+			s->stats->unknown_replies++;
+			session_printf(s, stderr, "Got unknown reply '%c' from the device, aborting.\n", reply[0]);
+			return 0;
+	}
+	return 1;
+}
+
+/* Handles the replies that have already arrived, without waiting */
+static int poll_replies(struct sfl_session *s)
+{
+	struct pollfd pfd;
+
+	while(s->count > 0) {
+		pfd.fd = s->fd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, 0) <= 0) break;
+		if(!wait_reply(s)) return 0;
+	}
+	return 1;
+}
+
+static int queue(struct sfl_session *s, const struct sfl_frame *frame,
+	unsigned char *reply, int reply_length,
+	const unsigned char *data, int data_length, unsigned int address)
+{
+	struct sfl_request *r;
+
+	while((s->count >= s->window) || (s->held && (s->count > 0)))
+		if(!wait_reply(s)) return 0;
+	r = &s->inflight[(s->head + s->count) % SFL_WINDOW_MAX];
+	r->frame = *frame;
+	r->frame.seq = s->next_seq++;
+	seal_frame(s, &r->frame);
+	r->reply = reply;
+	r->reply_length = reply_length;
+	r->data = data;
+	r->data_length = data_length;
+	r->address = address;
+	r->done = 0;
+	gettimeofday(&r->sent, NULL);
+	s->count++;
+	s->stats->frames++;
+	/* Catch SFL_ACK_HOLD before the next frame */
+	return write_frame(s, &r->frame) && poll_replies(s);
+}
+
+/* Sends the data left over by split frames */
+static int queue_splits(struct sfl_session *s)
+{
+	struct sfl_split split;
+	struct sfl_frame frame;
+	int n;
+
+	while(s->nsplits > 0) {
+		split = s->splits[--s->nsplits];
+		n = build_load(s, &frame, split.data, split.length, split.address);
+		if(n < split.length) {
+			s->splits[s->nsplits].data = split.data + n;
+			s->splits[s->nsplits].length = split.length - n;
+			s->splits[s->nsplits].address = split.address + n;
+			s->nsplits++;
+		}
+		if(!queue(s, &frame, NULL, 0, split.data, n, split.address))
+			return 0;
+	}
+	return 1;
+}
+
+/* length, cmd and payload must be filled in.
+ * If reply is not NULL, the device is expected to answer with
+ * reply_length bytes of data, which are stored there by the time
+ * the frame is retired.
+ */
+static int queue_request(struct sfl_session *s, const struct sfl_frame *frame,
+	unsigned char *reply, int reply_length)
+{
+	return queue_splits(s) && queue(s, frame, reply, reply_length, NULL, 0, 0);
+}
+
+/* length, cmd and payload must be filled in */
+static int queue_frame(struct sfl_session *s, const struct sfl_frame *frame)
+{
+	return queue_request(s, frame, NULL, 0);
+}
+
+/* Frame built by build_load from length bytes of data. The data must stay
+ * in place until the frame has been acknowledged.
+ */
+static int queue_load(struct sfl_session *s, const struct sfl_frame *frame,
+	const unsigned char *data, int length, unsigned int address)
+{
+	return queue_splits(s) && queue(s, frame, NULL, 0, data, length, address);
+}
+
+static int flush_frames(struct sfl_session *s)
+{
+	while((s->count > 0) || (s->nsplits > 0)) {
+		if(!queue_splits(s)) return 0;
+		if((s->count > 0) && !wait_reply(s)) return 0;
+	}
+	return 1;
+}
+
+/* length, cmd and payload must be filled in */
+static int send_frame(struct sfl_session *s, const struct sfl_frame *frame)
+{
+	return queue_frame(s, frame) && flush_frames(s);
+}
+
+static void set_timeout(struct sfl_session *s)
+{
+	/* Leave enough time to get the whole window through */
+	s->timeout = REPLY_TIMEOUT
+		+ 1000LL*s->window*(s->max_payload+8)*10/s->baudrate;
+}
+
+/* Returns 0 if the device does not answer */
+static int negotiate(struct sfl_session *s, int window, int compress)
+{
+	struct sfl_frame frame;
+	unsigned char reply[2];
+	int requested;
+	int attempts;
+	int r;
+
+	s->features = 0;
+	s->window = 1;
+	s->max_payload = SFL_PAYLOAD_CLASSIC;
+	s->payload = SFL_PAYLOAD_CLASSIC;
+	s->clean = 0;
+	s->timeout = REPLY_TIMEOUT;
+	s->next_seq = 0;
+	s->head = 0;
+	s->count = 0;
+	s->held = 0;
+	s->nsplits = 0;
+	if(window > SFL_WINDOW_MAX) window = SFL_WINDOW_MAX;
+	requested = SFL_FEATURE_CRC32|SFL_FEATURE_FILL|SFL_FEATURE_BAUD;
+	if(window > 0)
+		requested |= SFL_FEATURE_WINDOW|SFL_FEATURE_LARGE|SFL_FEATURE_SELECTIVE;
+	if(compress)
+		requested |= SFL_FEATURE_COMPRESS;
+
+	frame.length = 2;
+	frame.cmd = SFL_CMD_HELLO;
+	frame.payload[0] = requested;
+	frame.payload[1] = window > 0 ? window : 1;
+	seal_frame(s, &frame);
+	/* The device stays in classic mode until it has got the frame */
+	for(attempts=0;;attempts++) {
+		if(attempts == MAX_TIMEOUTS) {
+			session_printf(s, stderr, "No reply to the session negotiation, aborting.\n");
+			return 0;
+		}
+		if(!write_frame(s, &frame)) return 0;
+		r = read_timeout(s->fd, reply, 1, s->timeout);
+		if(r < 0) {
+			session_perror(s, "Unable to read from serial port.");
+			return 0;
+		}
+		if(r == 0) {
+			s->stats->timeouts++;
+			continue;
+		}
+		if(reply[0] == SFL_ACK_CRCERROR) {
+			s->stats->crc_errors++;
+			continue;
+		}
+		/* Older BIOSes reply SFL_ACK_UNKNOWN */
+		if(reply[0] == SFL_ACK_UNKNOWN) {
+			session_printf(s, stdout, "Device does not support protocol extensions.\n");
+			return 1;
+		}
+		if(reply[0] == SFL_ACK_SUCCESS)
+			break;
+		s->stats->unknown_replies++;
+		session_printf(s, stderr, "Got unknown reply '%c' from the device, aborting.\n", reply[0]);
+		return 0;
+	}
+	/* The device has switched to the new mode */
+	r = read_timeout(s->fd, reply, 2, s->timeout);
+	if(r <= 0) {
+		if(r < 0)
+			session_perror(s, "Unable to read from serial port.");
+		else
+			session_printf(s, stderr, "Incomplete reply to the session negotiation, aborting.\n");
+		return 0;
+	}
+	s->features = reply[0] & requested;
+	if(s->features & SFL_FEATURE_WINDOW) {
+		s->window = reply[1];
+		if(s->window > window) s->window = window;
+		if(s->window < 1) s->window = 1;
+		if(s->features & SFL_FEATURE_LARGE)
+			s->max_payload = SFL_PAYLOAD_MAX;
+		s->payload = s->max_payload < MIN_PAYLOAD ? s->max_payload : MIN_PAYLOAD;
+		set_timeout(s);
+		session_printf(s, stdout, "Using windowed transfers (%d frames of up to %d bytes).\n",
+			s->window, s->max_payload);
+	}
+	if(s->features & SFL_FEATURE_COMPRESS)
+		session_printf(s, stdout, "Using compressed transfers.\n");
+	return 1;
+}
+
+static int wait_baud_confirm(int fd)
+{
+	static const char str[SFL_BAUD_CONFIRM_LEN] = SFL_BAUD_CONFIRM;
+	unsigned char c;
+	int recognized;
+	int r;
+
+	recognized = 0;
+	while(1) {
+		r = read_timeout(fd, &c, 1, BAUD_CONFIRM_TIMEOUT);
+		if(r <= 0) return 0;
+		if(c == str[recognized]) {
+			recognized++;
+			if(recognized == SFL_BAUD_CONFIRM_LEN)
+				return 1;
+		} else {
+			if(c == str[0])
+				recognized = 1;
+			else
+				recognized = 0;
+		}
+	}
+}
+
+/* Moves the session to another baud rate, or stays at the current one
+ * if the device or the serial port cannot use it.
+ * Returns 0 if the device stopped responding.
+ */
+static int change_baudrate(struct sfl_session *s, int baudrate)
+{
+	static const char str[SFL_BAUD_CONFIRM_LEN] = SFL_BAUD_CONFIRM;
+	struct sfl_frame frame;
+	unsigned char result[4];
+	int actual;
+	int i;
+
+	if(!(s->features & SFL_FEATURE_BAUD)) {
+		session_printf(s, stdout, "Device cannot change its baud rate, staying at %d.\n", s->baudrate);
+		return 1;
+	}
+
+	frame.length = 4;
+	frame.cmd = SFL_CMD_BAUD;
+	frame.payload[0] = (baudrate & 0xff000000) >> 24;
+	frame.payload[1] = (baudrate & 0x00ff0000) >> 16;
+	frame.payload[2] = (baudrate & 0x0000ff00) >> 8;
+	frame.payload[3] = (baudrate & 0x000000ff);
+	if(!queue_request(s, &frame, result, 4) || !flush_frames(s))
+		return 0;
+	actual = ((int)result[0] << 24)|((int)result[1] << 16)
+		|((int)result[2] << 8)|(int)result[3];
+	if(actual == 0) {
+		session_printf(s, stdout, "Device cannot use %d baud, staying at %d.\n", baudrate, s->baudrate);
+		return 1;
+	}
+
+	/* The device has switched after sending its reply */
+	if(set_serial_speed(s->fd, actual) == 0) {
+		for(i=0;i<BAUD_ATTEMPTS;i++) {
+			if(!write_exact(s->fd, str, SFL_BAUD_CONFIRM_LEN)) {
+				session_perror(s, "Unable to write to serial port.");
+				return 0;
+			}
+			if(wait_baud_confirm(s->fd)) {
+				session_printf(s, stdout, "Switched to %d baud.\n", actual);
+				s->baudrate = actual;
+				set_timeout(s);
+				return 1;
+			}
+		}
+		session_printf(s, stdout, "Device did not confirm %d baud, staying at %d.\n", actual, s->baudrate);
+	} else
+		session_perror(s, "Unable to set serial port speed, staying at the current rate.");
+
+	/* Let the device give up and go back */
+	usleep(1000*BAUD_FALLBACK_DELAY);
+	set_serial_speed(s->fd, s->baudrate);
+	tcflush(s->fd, TCIFLUSH);
+	return 1;
+}
+
+static void build_crc32(struct sfl_frame *frame, unsigned int address, unsigned int length)
+{
+	frame->length = 8;
+	frame->cmd = SFL_CMD_CRC32;
+	frame->payload[0] = (address & 0xff000000) >> 24;
+	frame->payload[1] = (address & 0x00ff0000) >> 16;
+	frame->payload[2] = (address & 0x0000ff00) >> 8;
+	frame->payload[3] = (address & 0x000000ff);
+	frame->payload[4] = (length & 0xff000000) >> 24;
+	frame->payload[5] = (length & 0x00ff0000) >> 16;
+	frame->payload[6] = (length & 0x0000ff00) >> 8;
+	frame->payload[7] = (length & 0x000000ff);
+}
+
+static unsigned int get_crc32_reply(const unsigned char *reply)
+{
+	return ((unsigned int)reply[0] << 24)
+		|((unsigned int)reply[1] << 16)
+		|((unsigned int)reply[2] << 8)
+		|((unsigned int)reply[3]);
+}
+
+/* Compares the CRC32 of each block of the image with the contents of
+ * the device memory. Returns an array telling which blocks differ.
+ */
+static unsigned char *find_changed_blocks(struct sfl_session *s,
+	const unsigned char *data, int length, unsigned int address)
+{
+	struct sfl_frame frame;
+	int nblocks;
+	unsigned char *remote;
+	unsigned char *changed;
+	unsigned int offset;
+	unsigned int size;
+	unsigned int crc;
+	int nchanged;
+	int i;
+
+	nblocks = (length + DELTA_BLOCK - 1)/DELTA_BLOCK;
+	remote = malloc(4*nblocks);
+	changed = malloc(nblocks+1);
+	if((remote == NULL) || (changed == NULL)) {
+		session_perror(s, "Unable to allocate memory for block CRCs.");
+		free(remote);
+		free(changed);
+		return NULL;
+	}
+
+	for(i=0;i<nblocks;i++) {
+		offset = i*DELTA_BLOCK;
+		size = length - offset < DELTA_BLOCK ? length - offset : DELTA_BLOCK;
+		build_crc32(&frame, address + offset, size);
+		if(!queue_request(s, &frame, &remote[4*i], 4)) {
+			free(remote);
+			free(changed);
+			return NULL;
+		}
+	}
+	if(!flush_frames(s)) {
+		free(remote);
+		free(changed);
+		return NULL;
+	}
+
+	nchanged = 0;
+	for(i=0;i<nblocks;i++) {
+		offset = i*DELTA_BLOCK;
+		size = length - offset < DELTA_BLOCK ? length - offset : DELTA_BLOCK;
+		crc = get_crc32_reply(&remote[4*i]);
+		changed[i] = crc != crc32(&data[offset], size);
+		if(changed[i]) nchanged++;
+	}
+	free(remote);
+	session_printf(s, stdout, "%d of %d blocks differ.\n", nchanged, nblocks);
+	return changed;
+}
+
+/* Returns 1 if the CRC32 of the device memory range is the expected one */
+static int verify_range(struct sfl_session *s, unsigned int address, unsigned int length, unsigned int expected)
+{
+	struct sfl_frame frame;
+	unsigned char reply[4];
+	unsigned int crc;
+
+	build_crc32(&frame, address, length);
+	if(!queue_request(s, &frame, reply, 4)) return 0;
+	if(!flush_frames(s)) return 0;
+	crc = get_crc32_reply(reply);
+	if(crc != expected) {
+		session_printf(s, stderr, "Verification failed for 0x%08x-0x%08x: CRC32 is %08x, expected %08x.\n",
+			address, address + length - 1, crc, expected);
+		return 0;
+	}
+	return 1;
+}
+
+static void build_fill(struct sfl_frame *frame, unsigned int address, unsigned int length, unsigned char value)
+{
+	frame->length = 9;
+	frame->cmd = SFL_CMD_FILL;
+	frame->payload[0] = (address & 0xff000000) >> 24;
+	frame->payload[1] = (address & 0x00ff0000) >> 16;
+	frame->payload[2] = (address & 0x0000ff00) >> 8;
+	frame->payload[3] = (address & 0x000000ff);
+	frame->payload[4] = (length & 0xff000000) >> 24;
+	frame->payload[5] = (length & 0x00ff0000) >> 16;
+	frame->payload[6] = (length & 0x0000ff00) >> 8;
+	frame->payload[7] = (length & 0x000000ff);
+	frame->payload[8] = value;
+}
+
+/* Returns the number of bytes equal to the first one */
+static int run_length(const unsigned char *data, int length)
+{
+	int i;
+
+	for(i=1;i<length;i++)
+		if(data[i] != data[0]) break;
+	return i;
+}
+
+/* Returns the offset of the first run of at least FILL_MIN identical
+ * bytes, or length if there is none.
+ */
+static int find_run(const unsigned char *data, int length)
+{
+	int i;
+	int count;
+
+	count = 1;
+	for(i=1;i<length;i++) {
+		if(data[i] == data[i-1]) {
+			count++;
+			if(count == FILL_MIN) return i-FILL_MIN+1;
+		} else
+			count = 1;
+	}
+	return length;
+}
+
+/* Sends a memory range to the device. Returns the number of bytes sent
+ * on the wire, or -1 on error. The data must stay in place until the
+ * frames have been acknowledged.
+ */
+static int upload_data(struct sfl_session *s, const unsigned char *data, int length, unsigned int load_address, int delta)
+{
+	struct sfl_frame frame;
+	unsigned char *changed;
+	int ret;
+	int readbytes;
+	int position;
+	int limit;
+	int block;
+	int nblocks;
+	int sent;
+	
+	changed = NULL;
+	nblocks = (length + DELTA_BLOCK - 1)/DELTA_BLOCK;
+	if(delta) {
+		if(s->features & SFL_FEATURE_CRC32) {
+			changed = find_changed_blocks(s, data, length, load_address);
+			if(changed == NULL)
+				return -1;
+		} else
+			session_printf(s, stdout, "Device does not support CRC queries, sending the whole image.\n");
+	}
+	
+	position = 0;
+	sent = 0;
+	while(position < length) {
+		s->progress = 100*position/length;
+		if(s->port == NULL) {
+			printf("%d%%\r", s->progress);
+			fflush(stdout);
+		}
+		
+		limit = length;
+		if(changed != NULL) {
+			/* Only send runs of blocks that differ */
+			block = position/DELTA_BLOCK;
+			if(!changed[block]) {
+				position = (block+1)*DELTA_BLOCK;
+				continue;
+			}
+			while((block < nblocks) && changed[block])
+				block++;
+			if(block*DELTA_BLOCK < length)
+				limit = block*DELTA_BLOCK;
+		}
+		
+		if(s->features & SFL_FEATURE_FILL) {
+			/* Send runs of identical bytes as fills,
+			 * and stop data frames where the next run begins.
+			 */
+			readbytes = run_length(&data[position], limit - position);
+			if(readbytes >= FILL_MIN) {
+				build_fill(&frame, load_address + position, readbytes, data[position]);
+			} else {
+				if(limit - position > COMPRESS_FRAMES*s->payload)
+					limit = position + COMPRESS_FRAMES*s->payload;
+				limit = position + find_run(&data[position], limit - position);
+				readbytes = build_load(s, &frame, &data[position], limit - position, load_address + position);
+			}
+		} else
+			readbytes = build_load(s, &frame, &data[position], limit - position, load_address + position);
+		if(frame.cmd == SFL_CMD_FILL)
+			ret = queue_frame(s, &frame);
+		else
+			ret = queue_load(s, &frame, &data[position], readbytes, load_address + position);
+		if(!ret) {
+			free(changed);
+			return -1;
+		}
+		
+		position += readbytes;
+		sent += frame.length;
+		s->stats->payload_bytes += readbytes;
+	}
+	free(changed);
+	return sent;
+}
+
+/* Sends a memory range filled with a single value */
+static int upload_fill(struct sfl_session *s, unsigned int address, int length, unsigned char value)
+{
+	struct sfl_frame frame;
+	unsigned char *data;
+	int sent;
+
+	if(s->features & SFL_FEATURE_FILL) {
+		build_fill(&frame, address, length, value);
+		if(!queue_frame(s, &frame)) return -1;
+		s->stats->payload_bytes += length;
+		return frame.length;
+	}
+
+	data = malloc(length);
+	if(data == NULL) {
+		session_perror(s, "Unable to allocate memory for the image.");
+		return -1;
+	}
+	memset(data, value, length);
+	sent = upload_data(s, data, length, address, 0);
+	if((sent >= 0) && !flush_frames(s))
+		sent = -1;
+	free(data);
+	return sent;
+}
+
+static unsigned int elf_word(const unsigned char *p, int bigendian, int size)
+{
+	unsigned int r;
+	int i;
+
+	r = 0;
+	for(i=0;i<size;i++)
+		r |= (unsigned int)p[bigendian ? i : size-1-i] << 8*(size-1-i);
+	return r;
+}
+
+/* Loads the PT_LOAD segments of an ELF file at their physical addresses,
+ * and checks each of them afterwards if verify is set.
+ * Returns the number of bytes sent, or -1 on error.
+ */
+static int upload_elf(struct sfl_session *s, const unsigned char *data, int length, int delta, int verify, unsigned int *entry)
+{
+	static const unsigned char zeros[DELTA_BLOCK];
+	unsigned int crc, zeroed;
+	int be;
+	unsigned int phoff, phentsize, phnum;
+	const unsigned char *ph;
+	unsigned int offset, paddr, filesz, memsz;
+	unsigned int i;
+	int sent, r;
+
+	if((length < 52) || (data[4] != 1)) {
+		session_printf(s, stderr, "Only 32-bit ELF files are supported.\n");
+		return -1;
+	}
+	be = data[5] == 2;
+	*entry = elf_word(&data[24], be, 4);
+	phoff = elf_word(&data[28], be, 4);
+	phentsize = elf_word(&data[42], be, 2);
+	phnum = elf_word(&data[44], be, 2);
+	if((phentsize < 32) || (phoff > length) || (phnum > (length - phoff)/phentsize)) {
+		session_printf(s, stderr, "Invalid ELF program header table.\n");
+		return -1;
+	}
+
+	sent = 0;
+	for(i=0;i<phnum;i++) {
+		ph = &data[phoff + i*phentsize];
+		if(elf_word(&ph[0], be, 4) != 1) continue; /* PT_LOAD */
+		offset = elf_word(&ph[4], be, 4);
+		paddr = elf_word(&ph[12], be, 4);
+		filesz = elf_word(&ph[16], be, 4);
+		memsz = elf_word(&ph[20], be, 4);
+		if((offset > length) || (filesz > length - offset) || (filesz > memsz)) {
+			session_printf(s, stderr, "Invalid ELF segment %d.\n", i);
+			return -1;
+		}
+		session_printf(s, stdout, "Segment at 0x%08x: %u bytes, %u zeroed.\n", paddr, filesz, memsz - filesz);
+		if(filesz > 0) {
+			r = upload_data(s, &data[offset], filesz, paddr, delta);
+			if(r < 0) return -1;
+			sent += r;
+		}
+		if(memsz > filesz) {
+			r = upload_fill(s, paddr + filesz, memsz - filesz, 0);
+			if(r < 0) return -1;
+			sent += r;
+		}
+		if(verify && (memsz > 0)) {
+			if(!flush_frames(s)) return -1;
+			crc = crc32(&data[offset], filesz);
+			for(zeroed=filesz;zeroed<memsz;zeroed+=r) {
+				r = memsz - zeroed < DELTA_BLOCK ? memsz - zeroed : DELTA_BLOCK;
+				crc = crc32_update(crc, zeros, r);
+			}
+			if(!verify_range(s, paddr, memsz, crc)) return -1;
+		}
+	}
+	return sent;
+}
+
+struct image {
+	const char *name;
+	unsigned char *data;
+	int length;
+	unsigned int crc;
+};
+
+/* Returns 1 on success, or 0 after having printed an error */
+static int load_image(struct image *img, const char *name, const char *filename)
+{
+	int fd;
+	int length;
+	int position;
+	int r;
+
+	img->name = name;
+	img->data = NULL;
+	img->length = 0;
+	img->crc = 0;
+	fd = open(filename, O_RDONLY);
+	if(fd == -1) {
+		fprintf(stderr, "[FLTERM] Unable to open %s image: %s\n", name, strerror(errno));
+		return 0;
+	}
+	length = lseek(fd, 0, SEEK_END);
+	lseek(fd, 0, SEEK_SET);
+	img->data = malloc(length+1);
+	if(img->data == NULL) {
+		perror("[FLTERM] Unable to allocate memory for the image.");
+		close(fd);
+		return 0;
+	}
+	position = 0;
+	while(position < length) {
+		r = read(fd, &img->data[position], length - position);
+		if(r <= 0) {
+			fprintf(stderr, "[FLTERM] Unable to read %s image: %s\n", name, strerror(errno));
+			free(img->data);
+			img->data = NULL;
+			close(fd);
+			return 0;
+		}
+		img->crc = crc32_update(img->crc, &img->data[position], r);
+		position += r;
+	}
+	close(fd);
+	img->length = length;
+	return 1;
+}
+
+static void free_image(struct image *img)
+{
+	free(img->data);
+	img->data = NULL;
+}
+
+/* Uploads an image. If entry is not NULL and the image is an ELF file,
+ * its segments are loaded where they belong and entry is set to its
+ * entry point. Otherwise, the image is loaded at load_address.
+ * With verify, the device memory is checked against the image CRC32.
+ */
+static int upload_image(struct sfl_session *s, const struct image *img, unsigned int load_address,
+	int delta, int verify, unsigned int *entry)
+{
+	int sent;
+	struct timeval t0;
+	struct timeval t1;
+	int millisecs;
+	
+	session_printf(s, stdout, "Uploading %s (%d bytes)...\n", img->name, img->length);
+	
+	gettimeofday(&t0, NULL);
+	
+	s->progress = 0;
+	if(verify && !(s->features & SFL_FEATURE_CRC32)) {
+		session_printf(s, stdout, "Device does not support CRC queries, %s will not be verified.\n", img->name);
+		verify = 0;
+	}
+	if((entry != NULL) && (img->length >= 4) && (memcmp(img->data, "\177ELF", 4) == 0))
+		sent = upload_elf(s, img->data, img->length, delta, verify, entry);
+	else {
+		sent = upload_data(s, img->data, img->length, load_address, delta);
+		if((sent >= 0) && verify && !verify_range(s, load_address, img->length, img->crc))
+			sent = -1;
+	}
+	if(sent < 0) return -1;
+	if(!flush_frames(s)) return -1;
+	s->progress = 100;
+	
+	gettimeofday(&t1, NULL);
+	
+	millisecs = (t1.tv_sec - t0.tv_sec)*1000 + (t1.tv_usec - t0.tv_usec)/1000;
+	if(millisecs == 0) millisecs = 1;
+	
+	session_printf(s, stdout, "Upload %s (%.1fKB/s, %d bytes sent).\n",
+		verify ? "complete and verified" : "complete",
+		1000.0*(double)img->length/((double)millisecs*1024.0), sent);
+	return img->length;
+}
+
+static void build_address_frame(struct sfl_frame *frame, unsigned char cmd, unsigned int address)
+{
+	frame->length = 4;
+	frame->cmd = cmd;
+	frame->payload[0] = (address & 0xff000000) >> 24;
+	frame->payload[1] = (address & 0x00ff0000) >> 16;
+	frame->payload[2] = (address & 0x0000ff00) >> 8;
+	frame->payload[3] = (address & 0x000000ff);
+}
+
+static const char sfl_magic_req[SFL_MAGIC_LEN] = SFL_MAGIC_REQ;
+static const char sfl_magic_ack[SFL_MAGIC_LEN] = SFL_MAGIC_ACK;
+
+struct boot_config {
+	int speed;
+	int window;
+	int compress;
+	int delta;
+	int verify;
+	const char *kernel_image;
+	unsigned int kernel_address;
+	const char *cmdline;
+	unsigned int cmdline_address;
+	const char *initrd_image;
+	unsigned int initrd_address;
+	const char *stats_json;
+};
+
+/* Runs a whole boot session once the magic string has been answered.
+ * initrd is NULL if there is none.
+ * Returns 1 if the device has been booted.
+ */
+static int boot_device(struct sfl_session *s, const struct boot_config *cfg,
+	const struct image *kernel, const struct image *initrd)
+{
+	struct sfl_frame frame;
+	unsigned int kernel_address;
+	unsigned int initrd_address;
+	int len;
+
+	if(!negotiate(s, cfg->window, cfg->compress))
+		return 0;
+	if((cfg->speed > 0) && (cfg->speed != s->baudrate)) {
+		if(!change_baudrate(s, cfg->speed))
+			return 0;
+	}
+	
+	kernel_address = cfg->kernel_address;
+	if(upload_image(s, kernel, kernel_address, cfg->delta, cfg->verify, &kernel_address) < 0)
+		return 0;
+	if(cfg->cmdline != NULL) {
+		session_printf(s, stdout, "Setting kernel command line: '%s'.\n", cfg->cmdline);
+
+		len = strlen(cfg->cmdline)+1;
+		if(len > (254-4)) {
+			session_printf(s, stderr, "Kernel command line too long, load aborted.\n");
+			return 0;
+		}
+		frame.length = len+4;
+		frame.cmd = SFL_CMD_LOAD;
+		frame.payload[0] = (cfg->cmdline_address & 0xff000000) >> 24;
+		frame.payload[1] = (cfg->cmdline_address & 0x00ff0000) >> 16;
+		frame.payload[2] = (cfg->cmdline_address & 0x0000ff00) >> 8;
+		frame.payload[3] = (cfg->cmdline_address & 0x000000ff);
+		strcpy((char *)&frame.payload[4], cfg->cmdline);
+		if(!send_frame(s, &frame)) return 0;
+		s->stats->payload_bytes += len;
+
+		build_address_frame(&frame, SFL_CMD_CMDLINE, cfg->cmdline_address);
+		if(!send_frame(s, &frame)) return 0;
+	}
+	if(initrd != NULL) {
+		initrd_address = cfg->initrd_address;
+		len = upload_image(s, initrd, initrd_address, cfg->delta, cfg->verify, NULL);
+		if(len <= 0) return 0;
+		
+		build_address_frame(&frame, SFL_CMD_INITRDSTART, initrd_address);
+		if(!send_frame(s, &frame)) return 0;
+
+		initrd_address += len-1;
+
+		build_address_frame(&frame, SFL_CMD_INITRDEND, initrd_address);
+		if(!send_frame(s, &frame)) return 0;
+	}
+
+	/* Send the jump command */
+	session_printf(s, stdout, "Booting the device.\n");
+	build_address_frame(&frame, SFL_CMD_JUMP, kernel_address);
+	if(!send_frame(s, &frame)) return 0;
+
+	session_printf(s, stdout, "Done.\n");
+	return 1;
+}
+
+/* Returns the baud rate the serial port is left at */
+static int answer_magic(int serialfd, int baudrate, const struct boot_config *cfg)
+{
+	struct image kernel, initrd;
+	struct sfl_session session;
+	struct sfl_stats stats;
+	int booted;
+	FILE *f;
+	
+	printf("[FLTERM] Received firmware download request from the device.\n");
+	
+	/* Images are read again for each request, so that they can be
+	 * rebuilt without restarting flterm.
+	 */
+	if(!load_image(&kernel, "kernel", cfg->kernel_image)) {
+		fprintf(stderr, "[FLTERM] Request ignored.\n");
+		return baudrate;
+	}
+	if(cfg->initrd_image != NULL) {
+		if(!load_image(&initrd, "initrd", cfg->initrd_image)) {
+			fprintf(stderr, "[FLTERM] Request ignored.\n");
+			free_image(&kernel);
+			return baudrate;
+		}
+	}
+
+	write_exact(serialfd, sfl_magic_ack, SFL_MAGIC_LEN);
+
+	init_stats(&stats);
+	init_session(&session, serialfd, baudrate, NULL, &stats);
+	booted = boot_device(&session, cfg, &kernel, cfg->initrd_image != NULL ? &initrd : NULL);
+	print_stats(&session);
+	if(cfg->stats_json != NULL) {
+		f = open_stats_json(cfg->stats_json);
+		if(f != NULL) {
+			print_stats_json(f, NULL, booted, session.baudrate, &stats);
+			close_stats_json(f);
+		}
+	}
+	free_stats(&stats);
+
+	if(cfg->initrd_image != NULL)
+		free_image(&initrd);
+	free_image(&kernel);
+	return session.baudrate;
+}
+
+/* Matches the SFL magic string over a buffer, carrying the state of the
+ * matcher across buffers in *recognized.
+ * Returns the number of bytes up to the end of the magic string,
+ * or -1 if the buffer does not complete it.
+ */
+static int scan_magic(const unsigned char *data, int length, int *recognized)
+{
+	const unsigned char *p;
+	int i;
+
+	i = 0;
+	while(i < length) {
+		if(*recognized == 0) {
+			/* Skip quickly to the next possible start */
+			p = memchr(&data[i], sfl_magic_req[0], length - i);
+			if(p == NULL) return -1;
+			i = p - data;
+		}
+		if(data[i] == sfl_magic_req[*recognized]) {
+			(*recognized)++;
+			if(*recognized == SFL_MAGIC_LEN) {
+				*recognized = 0;
+				return i+1;
+			}
+		} else {
+			if(data[i] == sfl_magic_req[0]) *recognized = 1; else *recognized = 0;
+		}
+		i++;
+	}
+	return -1;
+}
+
+static volatile sig_atomic_t terminate;
+
+static void terminate_handler(int signum)
+{
+	terminate = 1;
+}
+
+/* Opens and configures a serial port, in non-blocking mode.
+ * Returns the descriptor, or -1 on error.
+ */
+static int open_port(const char *serial_port, int doublerate, int *baudrate)
+{
+	int serialfd;
+	struct termios my_termios;
+	
+	serialfd = open(serial_port, O_RDWR|O_NOCTTY);
+	if(serialfd == -1)
+		return -1;
+	
+	/* Thanks to Julien Schmitt (GTKTerm) for figuring out the correct parameters
+	 * to put into that weird struct.
+	 */
+	tcgetattr(serialfd, &my_termios);
+	my_termios.c_cflag = doublerate ? B230400 : B115200;
+	*baudrate = doublerate ? 230400 : 115200;
+	my_termios.c_cflag |= CS8;
+	my_termios.c_cflag |= CREAD;
+	my_termios.c_iflag = IGNPAR | IGNBRK;
+	my_termios.c_cflag |= CLOCAL;
+	my_termios.c_oflag = 0;
+	my_termios.c_lflag = 0;
+	my_termios.c_cc[VTIME] = 0;
+	my_termios.c_cc[VMIN] = 1;
+	tcsetattr(serialfd, TCSANOW, &my_termios);
+	tcflush(serialfd, TCOFLUSH);
+	tcflush(serialfd, TCIFLUSH);
+	
+	/* poll() behaves strangely when the serial port descriptor is in
+	 * blocking mode, so keep it non-blocking for good. The SFL code
+	 * copes with that.
+	 */
+	fcntl(serialfd, F_SETFL, fcntl(serialfd, F_GETFL, 0)|O_NONBLOCK);
+	return serialfd;
+}
+
+/* Discards input until the line has been quiet for timeout ms */
+static void drain_input(int fd, int timeout)
+{
+	unsigned char buffer[256];
+	struct pollfd pfd;
+
+	while(1) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, timeout) <= 0) return;
+		if((read(fd, buffer, sizeof(buffer)) <= 0) && (errno != EAGAIN) && (errno != EINTR))
+			return;
+	}
+}
+
+/* Skips input up to and including str.
+ * Returns 1 once found, 0 on timeout and -1 on error.
+ */
+static int wait_string(int fd, const char *str, int length, int timeout)
+{
+	unsigned char c;
+	int recognized;
+	int r;
+
+	recognized = 0;
+	while(recognized < length) {
+		r = read_timeout(fd, &c, 1, timeout);
+		if(r <= 0) return r;
+		if(c == str[recognized])
+			recognized++;
+		else
+			recognized = c == str[0] ? 1 : 0;
+	}
+	return 1;
+}
+
+/* Runs the "mrb" shell command for length bytes at offset from the
+ * beginning of the dump, and stores the chunks that arrive intact.
+ * Returns 1 if the whole stream has been received, 0 if it was broken
+ * and -1 on error.
+ */
+static int dump_pass(int fd, unsigned char *dump, unsigned char *received,
+	unsigned int address, unsigned int offset, unsigned int length)
+{
+	static const char magic[SFL_DUMP_MAGIC_LEN] = SFL_DUMP_MAGIC;
+	char command[64];
+	unsigned char record[6+SFL_DUMP_CHUNK+2];
+	unsigned char c;
+	unsigned int chunk_adr, chunk_len;
+	unsigned int expected, crc;
+	int complete;
+	int r;
+
+	sprintf(command, "\nmrb 0x%08x 0x%x\n", address + offset, length);
+	if(!write_exact(fd, command, strlen(command))) return -1;
+
+	/* Skip the echo of the command */
+	r = wait_string(fd, magic, SFL_DUMP_MAGIC_LEN, DUMP_TIMEOUT);
+	if(r <= 0) return r;
+
+	complete = 1;
+	while(1) {
+		r = read_timeout(fd, &c, 1, DUMP_TIMEOUT);
+		if(r <= 0) return r;
+		if(c == SFL_DUMP_END)
+			break;
+		if(c != SFL_DUMP_DATA) return 0;
+		r = read_timeout(fd, record, 6, DUMP_TIMEOUT);
+		if(r <= 0) return r;
+		chunk_adr = ((unsigned int)record[0] << 24)|((unsigned int)record[1] << 16)
+			|((unsigned int)record[2] << 8)|(unsigned int)record[3];
+		chunk_len = ((unsigned int)record[4] << 8)|(unsigned int)record[5];
+		/* A corrupted length makes us lose track of the stream */
+		if(chunk_len > SFL_DUMP_CHUNK) return 0;
+		r = read_timeout(fd, &record[6], chunk_len+2, DUMP_TIMEOUT);
+		if(r <= 0) return r;
+		crc = ((unsigned int)record[6+chunk_len] << 8)|(unsigned int)record[6+chunk_len+1];
+		if((crc != crc16(record, 6+chunk_len))
+		  || (chunk_adr < address + offset)
+		  || (chunk_adr - address + chunk_len > offset + length)
+		  || ((chunk_adr - address) % SFL_DUMP_CHUNK != 0)) {
+			complete = 0;
+			continue;
+		}
+		memcpy(&dump[chunk_adr - address], &record[6], chunk_len);
+		received[(chunk_adr - address)/SFL_DUMP_CHUNK] = 1;
+	}
+
+	r = read_timeout(fd, record, 4, DUMP_TIMEOUT);
+	if(r <= 0) return r;
+	if(complete) {
+		/* Catch whatever the CRC16 could have missed */
+		expected = get_crc32_reply(record);
+		if(crc32(&dump[offset], length) != expected) {
+			memset(&received[offset/SFL_DUMP_CHUNK], 0,
+				(length + SFL_DUMP_CHUNK - 1)/SFL_DUMP_CHUNK);
+		}
+	}
+	return 1;
+}
+
+/* Reads device memory through the BIOS shell and writes it to a file.
+ * Returns 1 on success.
+ */
+static int dump_memory(const char *serial_port, int doublerate, const char *filename,
+	unsigned int address, unsigned int length)
+{
+	int serialfd;
+	int baudrate;
+	unsigned char *dump;
+	unsigned char *received;
+	unsigned int nchunks;
+	unsigned int i, j;
+	unsigned int offset, end;
+	int pass;
+	int missing;
+	int r;
+	FILE *f;
+	struct timeval t0, t1;
+	double elapsed;
+
+	serialfd = open_port(serial_port, doublerate, &baudrate);
+	if(serialfd == -1) {
+		perror("[FLTERM] Unable to open serial port");
+		return 0;
+	}
+	nchunks = (length + SFL_DUMP_CHUNK - 1)/SFL_DUMP_CHUNK;
+	dump = malloc(length+1);
+	received = calloc(nchunks+1, 1);
+	if((dump == NULL) || (received == NULL)) {
+		perror("[FLTERM] Unable to allocate memory for the dump");
+		free(dump);
+		free(received);
+		close(serialfd);
+		return 0;
+	}
+
+	printf("[FLTERM] Reading %u bytes at 0x%08x...\n", length, address);
+	gettimeofday(&t0, NULL);
+	missing = nchunks;
+	for(pass=0;(pass<DUMP_PASSES) && (missing > 0);pass++) {
+		if(pass > 0)
+			printf("[FLTERM] Requesting %d damaged chunk(s) again.\n", missing);
+		/* Request each run of missing chunks */
+		i = 0;
+		while(i < nchunks) {
+			if(received[i]) {
+				i++;
+				continue;
+			}
+			for(j=i;(j<nchunks) && !received[j];j++);
+			offset = i*SFL_DUMP_CHUNK;
+			end = j*SFL_DUMP_CHUNK < length ? j*SFL_DUMP_CHUNK : length;
+			r = dump_pass(serialfd, dump, received, address, offset, end - offset);
+			if(r < 0) {
+				perror("[FLTERM] Serial port error");
+				pass = DUMP_PASSES;
+				break;
+			}
+			if(r == 0)
+				drain_input(serialfd, DUMP_DRAIN);
+			i = j;
 		}
-	} while(retry);
+		missing = 0;
+		for(i=0;i<nchunks;i++)
+			if(!received[i]) missing++;
+	}
+	gettimeofday(&t1, NULL);
+	close(serialfd);
+	free(received);
+
+	if(missing > 0) {
+		fprintf(stderr, "[FLTERM] Unable to read %d chunk(s) of the dump.\n", missing);
+		free(dump);
+		return 0;
+	}
+	f = fopen(filename, "wb");
+	if((f == NULL) || (fwrite(dump, 1, length, f) != length)) {
+		fprintf(stderr, "[FLTERM] Unable to write %s: %s\n", filename, strerror(errno));
+		if(f != NULL) fclose(f);
+		free(dump);
+		return 0;
+	}
+	fclose(f);
+	free(dump);
+	elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec)/1000000.0;
+	printf("[FLTERM] Wrote %s (%.1fKB/s).\n", filename, length/(elapsed*1024.0));
 	return 1;
 }
 
-static int upload_fd(int serialfd, const char *name, int firmwarefd, unsigned int load_address)
+struct batch_op {
+	unsigned char op;
+	unsigned int args[3];
+};
+
+/* Reads a list of memory operations, one per line:
+ *   w <address> <value>
+ *   r <address>
+ *   c <destination> <source> <words>
+ * Returns the number of operations, or -1 after having printed an error.
+ */
+static int parse_batch(const char *filename, struct batch_op **ops)
 {
-	struct sfl_frame frame;
-	int readbytes;
-	int length;
-	int position;
-	unsigned int current_address;
-	struct timeval t0;
-	struct timeval t1;
-	int millisecs;
-	
-	length = lseek(firmwarefd, 0, SEEK_END);
-	lseek(firmwarefd, 0, SEEK_SET);
-	
-	printf("[FLTERM] Uploading %s (%d bytes)...\n", name, length);
-	
-	gettimeofday(&t0, NULL);
-	
-	current_address = load_address;
-	position = 0;
-	while(1) {
-		printf("%d%%\r", 100*position/length);
-		fflush(stdout);
-	
-		readbytes = read(firmwarefd, &frame.payload[4], sizeof(frame.payload) - 4);
-		if(readbytes < 0) {
-			perror("[FLTERM] Unable to read image.");
+	FILE *f;
+	char line[256];
+	char *token;
+	char *endptr;
+	struct batch_op op;
+	int nargs;
+	int nops;
+	int lineno;
+	int i;
+
+	f = fopen(filename, "r");
+	if(f == NULL) {
+		fprintf(stderr, "[FLTERM] Unable to open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	*ops = NULL;
+	nops = 0;
+	lineno = 0;
+	while(fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		token = strtok(line, " \t\r\n");
+		if((token == NULL) || (token[0] == '#'))
+			continue;
+		if(strcmp(token, "w") == 0) {
+			op.op = SFL_BATCH_WRITE;
+			nargs = 2;
+		} else if(strcmp(token, "r") == 0) {
+			op.op = SFL_BATCH_READ;
+			nargs = 1;
+		} else if(strcmp(token, "c") == 0) {
+			op.op = SFL_BATCH_COPY;
+			nargs = 3;
+		} else
+			goto error;
+		for(i=0;i<nargs;i++) {
+			token = strtok(NULL, " \t\r\n");
+			if(token == NULL) goto error;
+			op.args[i] = strtoul(token, &endptr, 0);
+			if(*endptr != 0) goto error;
+		}
+		if(strtok(NULL, " \t\r\n") != NULL) goto error;
+		*ops = realloc(*ops, (nops+1)*sizeof(struct batch_op));
+		if(*ops == NULL) {
+			perror("[FLTERM] Unable to allocate memory for the operations");
+			fclose(f);
 			return -1;
 		}
-		if(readbytes == 0) break;
-		
-		frame.length = readbytes+4;
-		frame.cmd = SFL_CMD_LOAD;
-		frame.payload[0] = (current_address & 0xff000000) >> 24;
-		frame.payload[1] = (current_address & 0x00ff0000) >> 16;
-		frame.payload[2] = (current_address & 0x0000ff00) >> 8;
-		frame.payload[3] = (current_address & 0x000000ff);
-		
-		if(!send_frame(serialfd, &frame)) return -1;
-		
-		current_address += readbytes;
-		position += readbytes;
+		(*ops)[nops++] = op;
 	}
-	
-	gettimeofday(&t1, NULL);
-	
-	millisecs = (t1.tv_sec - t0.tv_sec)*1000 + (t1.tv_usec - t0.tv_usec)/1000;
-	
-	printf("[FLTERM] Upload complete (%.1fKB/s).\n", 1000.0*(double)length/((double)millisecs*1024.0));
-	return length;
-}
+	fclose(f);
+	return nops;
 
-static const char sfl_magic_req[SFL_MAGIC_LEN] = SFL_MAGIC_REQ;
-static const char sfl_magic_ack[SFL_MAGIC_LEN] = SFL_MAGIC_ACK;
+error:
+	fprintf(stderr, "[FLTERM] %s:%d: invalid operation\n", filename, lineno);
+	fclose(f);
+	free(*ops);
+	*ops = NULL;
+	return -1;
+}
 
-static void answer_magic(int serialfd,
-	const char *kernel_image, unsigned int kernel_address,
-	const char *cmdline, unsigned int cmdline_address,
-	const char *initrd_image, unsigned int initrd_address)
+static int encode_batch_op(unsigned char *p, const struct batch_op *op)
 {
-	int kernelfd, initrdfd;
-	struct sfl_frame frame;
-	
-	printf("[FLTERM] Received firmware download request from the device.\n");
-	
-	kernelfd = open(kernel_image, O_RDONLY);
-	if(kernelfd == -1) {
-		perror("[FLTERM] Unable to open kernel image (request ignored).");
-		return;
+	int nargs;
+	int i;
+
+	nargs = op->op == SFL_BATCH_WRITE ? 2 : op->op == SFL_BATCH_READ ? 1 : 3;
+	p[0] = op->op;
+	for(i=0;i<nargs;i++) {
+		p[1+4*i] = (op->args[i] & 0xff000000) >> 24;
+		p[2+4*i] = (op->args[i] & 0x00ff0000) >> 16;
+		p[3+4*i] = (op->args[i] & 0x0000ff00) >> 8;
+		p[4+4*i] = (op->args[i] & 0x000000ff);
 	}
-	initrdfd = -1;
-	if(initrd_image != NULL) {
-		initrdfd = open(initrd_image, O_RDONLY);
-		if(initrdfd == -1) {
-			perror("[FLTERM] Unable to open initrd image (request ignored).");
-			close(kernelfd);
-			return;
+	return 1+4*nargs;
+}
+
+/* Sends one operation list and gets the words read.
+ * Returns the length of the result, or -1 after having printed an error.
+ */
+static int send_batch(int fd, const unsigned char *list, int length, unsigned char *result)
+{
+	unsigned char packet[4+SFL_BATCH_MAX];
+	static const unsigned char repeat[4] = {
+		(SFL_BATCH_REPEAT & 0xff00) >> 8, SFL_BATCH_REPEAT & 0x00ff,
+		(SFL_BATCH_REPEAT & 0xff00) >> 8, SFL_BATCH_REPEAT & 0x00ff
+	};
+	unsigned char reply[4];
+	unsigned short crc;
+	unsigned int rlength;
+	int attempt;
+	int r;
+
+	crc = crc16(list, length);
+	packet[0] = (length & 0xff00) >> 8;
+	packet[1] = length & 0x00ff;
+	packet[2] = (crc & 0xff00) >> 8;
+	packet[3] = crc & 0x00ff;
+	memcpy(&packet[4], list, length);
+	if(!write_exact(fd, (char *)packet, 4+length)) goto ioerror;
+	for(attempt=0;attempt<BATCH_ATTEMPTS;attempt++) {
+		r = read_timeout(fd, reply, 1, BATCH_TIMEOUT);
+		if(r < 0) goto ioerror;
+		if((r == 1) && (reply[0] == SFL_ACK_CRCERROR)) {
+			/* The list has not been run */
+			if(!write_exact(fd, (char *)packet, 4+length)) goto ioerror;
+			continue;
+		}
+		if((r == 1) && (reply[0] == SFL_ACK_ERROR)) {
+			fprintf(stderr, "[FLTERM] Device rejected the operation list.\n");
+			return -1;
 		}
+		if((r == 1) && (reply[0] == SFL_ACK_DATA)) {
+			r = read_timeout(fd, reply, 4, BATCH_TIMEOUT);
+			if(r < 0) goto ioerror;
+			rlength = ((unsigned int)reply[0] << 8)|reply[1];
+			if((r == 1) && (rlength <= SFL_BATCH_MAX)) {
+				r = read_timeout(fd, result, rlength, BATCH_TIMEOUT);
+				if(r < 0) goto ioerror;
+				if((r == 1) && (crc16(result, rlength) == (((unsigned int)reply[2] << 8)|reply[3])))
+					return rlength;
+			}
+		}
+		/* The reply is damaged or lost, but the list may have been run:
+		 * get the reply again rather than running the list twice.
+		 */
+		drain_input(fd, BATCH_DRAIN);
+		if(!write_exact(fd, (char *)repeat, 4)) goto ioerror;
 	}
+	fprintf(stderr, "[FLTERM] No valid reply from the device.\n");
+	return -1;
 
-	write_exact(serialfd, sfl_magic_ack, SFL_MAGIC_LEN);
-	
-	upload_fd(serialfd, "kernel", kernelfd, kernel_address);
-	if(cmdline != NULL) {
-		int len;
-
-		printf("[FLTERM] Setting kernel command line: '%s'.\n", cmdline);
+ioerror:
+	perror("[FLTERM] Serial port error");
+	return -1;
+}
 
-		len = strlen(cmdline)+1;
-		if(len > (254-4)) {
-			fprintf(stderr, "[FLTERM] Kernel command line too long, load aborted.\n");
-			close(initrdfd);
-			close(kernelfd);
-			return;
-		}
-		frame.length = len+4;
-		frame.cmd = SFL_CMD_LOAD;
-		frame.payload[0] = (cmdline_address & 0xff000000) >> 24;
-		frame.payload[1] = (cmdline_address & 0x00ff0000) >> 16;
-		frame.payload[2] = (cmdline_address & 0x0000ff00) >> 8;
-		frame.payload[3] = (cmdline_address & 0x000000ff);
-		strcpy((char *)&frame.payload[4], cmdline);
-		send_frame(serialfd, &frame);
-
-		frame.length = 4;
-		frame.cmd = SFL_CMD_CMDLINE;
-		frame.payload[0] = (cmdline_address & 0xff000000) >> 24;
-		frame.payload[1] = (cmdline_address & 0x00ff0000) >> 16;
-		frame.payload[2] = (cmdline_address & 0x0000ff00) >> 8;
-		frame.payload[3] = (cmdline_address & 0x000000ff);
-		send_frame(serialfd, &frame);
-	}
-	if(initrdfd != -1) {
-		int len;
-		
-		len = upload_fd(serialfd, "initrd", initrdfd, initrd_address);
-		if(len <= 0) return;
-		
-		frame.length = 4;
-		frame.cmd = SFL_CMD_INITRDSTART;
-		frame.payload[0] = (initrd_address & 0xff000000) >> 24;
-		frame.payload[1] = (initrd_address & 0x00ff0000) >> 16;
-		frame.payload[2] = (initrd_address & 0x0000ff00) >> 8;
-		frame.payload[3] = (initrd_address & 0x000000ff);
-		send_frame(serialfd, &frame);
+/* Runs a list of memory operations through the BIOS shell and prints
+ * the values read. Returns 1 on success.
+ */
+static int run_batch(const char *serial_port, int doublerate, const char *filename)
+{
+	static const char magic[SFL_BATCH_MAGIC_LEN] = SFL_BATCH_MAGIC;
+	static const char command[] = "\nbatch\n";
+	struct batch_op *ops;
+	int nops;
+	unsigned char list[SFL_BATCH_MAX];
+	unsigned char result[SFL_BATCH_MAX];
+	unsigned char op[16];
+	int serialfd;
+	int baudrate;
+	int first, i, j;
+	int length, oplength;
+	int rlength;
+	int npackets;
+	int ok;
+	struct timeval t0, t1;
 
-		initrd_address += len-1;
+	nops = parse_batch(filename, &ops);
+	if(nops < 0) return 0;
+	serialfd = open_port(serial_port, doublerate, &baudrate);
+	if(serialfd == -1) {
+		perror("[FLTERM] Unable to open serial port");
+		free(ops);
+		return 0;
+	}
 
-		frame.length = 4;
-		frame.cmd = SFL_CMD_INITRDEND;
-		frame.payload[0] = (initrd_address & 0xff000000) >> 24;
-		frame.payload[1] = (initrd_address & 0x00ff0000) >> 16;
-		frame.payload[2] = (initrd_address & 0x0000ff00) >> 8;
-		frame.payload[3] = (initrd_address & 0x000000ff);
-		send_frame(serialfd, &frame);
+	ok = 0;
+	gettimeofday(&t0, NULL);
+	if(!write_exact(serialfd, command, strlen(command))
+	  || (wait_string(serialfd, magic, SFL_BATCH_MAGIC_LEN, BATCH_TIMEOUT) != 1)) {
+		fprintf(stderr, "[FLTERM] The device does not enter batch mode.\n");
+		goto out;
+	}
+	npackets = 0;
+	first = 0;
+	while(first < nops) {
+		/* Pack as many operations as possible */
+		length = 0;
+		for(i=first;i<nops;i++) {
+			oplength = encode_batch_op(op, &ops[i]);
+			if(length + oplength > SFL_BATCH_MAX) break;
+			memcpy(&list[length], op, oplength);
+			length += oplength;
+		}
+		rlength = send_batch(serialfd, list, length, result);
+		if(rlength < 0) goto out;
+		npackets++;
+		for(j=first;j<i;j++) {
+			if(ops[j].op != SFL_BATCH_READ) continue;
+			if(rlength < 4) break;
+			printf("0x%08x: 0x%08x\n", ops[j].args[0],
+				((unsigned int)result[0] << 24)|((unsigned int)result[1] << 16)
+				|((unsigned int)result[2] << 8)|result[3]);
+			memmove(result, &result[4], rlength - 4);
+			rlength -= 4;
+		}
+		first = i;
 	}
+	/* Leave batch mode */
+	if(send_batch(serialfd, list, 0, result) < 0) goto out;
+	gettimeofday(&t1, NULL);
+	printf("[FLTERM] %d operations in %d packet(s), %.1fms.\n", nops, npackets,
+		(t1.tv_sec - t0.tv_sec)*1000.0 + (t1.tv_usec - t0.tv_usec)/1000.0);
+	ok = 1;
 
-	/* Send the jump command */
-	printf("[FLTERM] Booting the device.\n");
-	frame.length = 4;
-	frame.cmd = SFL_CMD_JUMP;
-	frame.payload[0] = (kernel_address & 0xff000000) >> 24;
-	frame.payload[1] = (kernel_address & 0x00ff0000) >> 16;
-	frame.payload[2] = (kernel_address & 0x0000ff00) >> 8;
-	frame.payload[3] = (kernel_address & 0x000000ff);
-	if(!send_frame(serialfd, &frame)) return;
+out:
+	close(serialfd);
+	free(ops);
+	return ok;
+}
 
-	printf("[FLTERM] Done.\n");
+static void catch_termination()
+{
+	struct sigaction sa;
 
-	close(initrdfd);
-	close(kernelfd);
+	/* Let loops exit cleanly on ^C so that statistics get printed
+	 * and the terminal settings restored.
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = terminate_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 }
 
-static void do_terminal(char *serial_port,
-	int doublerate,
-	const char *kernel_image, unsigned int kernel_address,
-	const char *cmdline, unsigned int cmdline_address,
-	const char *initrd_image, unsigned int initrd_address)
+static void do_terminal(const char *serial_port, int doublerate, const struct boot_config *cfg)
 {
 	int serialfd;
-	struct termios my_termios;
-	char c;
+	int baudrate;
+	unsigned char rxbuf[TERM_BUFFER];
+	unsigned char txbuf[TERM_BUFFER];
+	int txlen;
 	int recognized;
 	struct pollfd fds[2];
-	int flags;
+	long long received, sent;
+	struct timeval t0, t1;
+	double elapsed;
+	int position;
+	int r;
 	
-	/* Open and configure the serial port */
-	serialfd = open(serial_port, O_RDWR|O_NOCTTY);
+	serialfd = open_port(serial_port, doublerate, &baudrate);
 	if(serialfd == -1) {
 		perror("Unable to open serial port");
 		return;
 	}
-	
-	/* Thanks to Julien Schmitt (GTKTerm) for figuring out the correct parameters
-	 * to put into that weird struct.
-	 */
-	tcgetattr(serialfd, &my_termios);
-	my_termios.c_cflag = doublerate ? B230400 : B115200;
-	my_termios.c_cflag |= CS8;
-	my_termios.c_cflag |= CREAD;
-	my_termios.c_iflag = IGNPAR | IGNBRK;
-	my_termios.c_cflag |= CLOCAL;
-	my_termios.c_oflag = 0;
-	my_termios.c_lflag = 0;
-	my_termios.c_cc[VTIME] = 0;
-	my_termios.c_cc[VMIN] = 1;
-	tcsetattr(serialfd, TCSANOW, &my_termios);
-	tcflush(serialfd, TCOFLUSH);
-	tcflush(serialfd, TCIFLUSH);
+	catch_termination();
 	
 	/* Prepare the fdset for poll() */
 	fds[0].fd = 0;
-	fds[0].events = POLLIN;
 	fds[1].fd = serialfd;
-	fds[1].events = POLLIN;
 
 	recognized = 0;
-	flags = fcntl(serialfd, F_GETFL, 0);
-	while(1) {
+	txlen = 0;
+	received = 0;
+	sent = 0;
+	gettimeofday(&t0, NULL);
+	while(!terminate) {
+		/* Only take keyboard input when there is room for it */
+		fds[0].events = txlen < sizeof(txbuf) ? POLLIN : 0;
+		fds[1].events = POLLIN;
+		if(txlen > 0)
+			fds[1].events |= POLLOUT;
 		fds[0].revents = 0;
 		fds[1].revents = 0;
 		
-		/* poll() behaves strangely when the serial port descriptor is in
-		 * blocking mode. So work around this.
-		 */
-		fcntl(serialfd, F_SETFL, flags|O_NONBLOCK);
-		if(poll(&fds[0], 2, -1) < 0) break;
-		fcntl(serialfd, F_SETFL, flags);
+		if(poll(&fds[0], 2, -1) < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
 		
-		if(fds[0].revents & POLLIN) {
-			read(0, &c, 1);
-			if(write(serialfd, &c, 1) <= 0) break;
+		if(fds[0].revents & (POLLIN|POLLHUP)) {
+			r = read(0, &txbuf[txlen], sizeof(txbuf) - txlen);
+			if(r > 0)
+				txlen += r;
+			else if(r == 0)
+				fds[0].fd = -1; /* end of input, keep listening to the device */
 		}
 		
-		if(fds[1].revents & POLLIN) {
-			if(read(serialfd, &c, 1) <= 0) break;
-			write(0, &c, 1);
+		if(fds[1].revents & POLLOUT) {
+			r = write(serialfd, txbuf, txlen);
+			if(r > 0) {
+				memmove(txbuf, &txbuf[r], txlen - r);
+				txlen -= r;
+				sent += r;
+			} else if((r < 0) && (errno != EAGAIN) && (errno != EINTR))
+				break;
+		}
+		
+		if(fds[1].revents & (POLLIN|POLLHUP|POLLERR)) {
+			r = read(serialfd, rxbuf, sizeof(rxbuf));
+			if(r < 0) {
+				if((errno == EAGAIN) || (errno == EINTR)) continue;
+				break;
+			}
+			if(r == 0) break;
+			received += r;
 			
-			if(c == sfl_magic_req[recognized]) {
-				recognized++;
-				if(recognized == SFL_MAGIC_LEN) {
-					/* We've got the magic string ! */
-					recognized = 0;
-					answer_magic(serialfd,
-						kernel_image, kernel_address,
-						cmdline, cmdline_address,
-						initrd_image, initrd_address);
+			position = 0;
+			while(position < r) {
+				int end;
+				
+				end = scan_magic(&rxbuf[position], r - position, &recognized);
+				if(end < 0) {
+					write_exact(0, (char *)&rxbuf[position], r - position);
+					break;
 				}
-			} else {
-				if(c == sfl_magic_req[0]) recognized = 1; else recognized = 0;
+				write_exact(0, (char *)&rxbuf[position], end);
+				position += end;
+				/* We've got the magic string ! */
+				baudrate = answer_magic(serialfd, baudrate, cfg);
 			}
 		}
 	}
 	
+	gettimeofday(&t1, NULL);
+	elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec)/1000000.0;
+	if(elapsed <= 0.0) elapsed = 1e-6;
+	printf("\n[FLTERM] Forwarded %lld bytes from the device (%.0f bytes/s) and %lld bytes to it in %.1fs.\n",
+		received, received/elapsed, sent, elapsed);
+	
+	close(serialfd);
+}
+
+/*
+ * Multi-port mode: one thread per port waits for the boot request of its
+ * board and runs the session, all sharing the images loaded once.
+ */
+
+enum {
+	JOB_WAITING,
+	JOB_UPLOADING,
+	JOB_BOOTED,
+	JOB_FAILED
+};
+
+struct port_job {
+	const char *port;
+	int doublerate;
+	const struct boot_config *cfg;
+	const struct image *kernel;
+	const struct image *initrd;
+	int retries;
+	int wait;
+	pthread_t thread;
+	int started;
+	struct sfl_session session;
+	volatile int state;
+	volatile int finished;
+	int attempts;
+	struct sfl_stats stats;
+	double elapsed;
+};
+
+/* Returns 1 when the magic string has been received, 0 on timeout or
+ * termination and -1 on error.
+ */
+static int wait_magic(int fd, int timeout)
+{
+	unsigned char buf[TERM_BUFFER];
+	struct pollfd pfd;
+	int recognized;
+	int r;
+
+	recognized = 0;
+	while(!terminate && (timeout > 0)) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		r = poll(&pfd, 1, 100);
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		if(r == 0) {
+			timeout -= 100;
+			continue;
+		}
+		r = read(fd, buf, sizeof(buf));
+		if(r < 0) {
+			if((errno == EAGAIN) || (errno == EINTR)) continue;
+			return -1;
+		}
+		if(r == 0) return -1;
+		if(scan_magic(buf, r, &recognized) >= 0)
+			return 1;
+	}
+	return 0;
+}
+
+static void *flash_port(void *arg)
+{
+	struct port_job *job = arg;
+	struct timeval t0, t1;
+	int serialfd;
+	int baudrate;
+	int base_baudrate;
+	int r;
+
+	gettimeofday(&t0, NULL);
+	job->state = JOB_FAILED;
+	serialfd = open_port(job->port, job->doublerate, &base_baudrate);
+	if(serialfd == -1) {
+		fprintf(stderr, "[FLTERM %s] Unable to open serial port: %s\n", job->port, strerror(errno));
+		job->finished = 1;
+		return NULL;
+	}
+	baudrate = base_baudrate;
+	job->session.baudrate = baudrate;
+	while(!terminate && (job->attempts <= job->retries)) {
+		job->state = JOB_WAITING;
+		r = wait_magic(serialfd, 1000*job->wait);
+		if(r <= 0) {
+			if(r == 0 && !terminate)
+				fprintf(stderr, "[FLTERM %s] No download request from the device.\n", job->port);
+			break;
+		}
+		job->attempts++;
+		job->state = JOB_UPLOADING;
+		write_exact(serialfd, sfl_magic_ack, SFL_MAGIC_LEN);
+		init_session(&job->session, serialfd, baudrate, job->port, &job->stats);
+		r = boot_device(&job->session, job->cfg, job->kernel, job->initrd);
+		if(r) {
+			job->state = JOB_BOOTED;
+			break;
+		}
+		/* The board comes back at the default rate when reset */
+		if(job->session.baudrate != base_baudrate) {
+			set_serial_speed(serialfd, base_baudrate);
+			tcflush(serialfd, TCIFLUSH);
+		}
+		if(job->attempts <= job->retries)
+			fprintf(stderr, "[FLTERM %s] Attempt %d failed, waiting for the device to retry.\n",
+				job->port, job->attempts);
+	}
+	if(job->state != JOB_BOOTED)
+		job->state = JOB_FAILED;
 	close(serialfd);
+	gettimeofday(&t1, NULL);
+	job->elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec)/1000000.0;
+	job->finished = 1;
+	return NULL;
+}
+
+static void print_job_status(struct port_job *jobs, int njobs)
+{
+	int i;
+
+	printf("\r");
+	for(i=0;i<njobs;i++) {
+		switch(jobs[i].state) {
+			case JOB_WAITING:
+				printf("%s: waiting  ", jobs[i].port);
+				break;
+			case JOB_UPLOADING:
+				printf("%s: %3d%%  ", jobs[i].port, jobs[i].session.progress);
+				break;
+			case JOB_BOOTED:
+				printf("%s: booted  ", jobs[i].port);
+				break;
+			case JOB_FAILED:
+				printf("%s: FAILED  ", jobs[i].port);
+				break;
+		}
+	}
+	fflush(stdout);
+}
+
+/* Returns the number of boards that could not be booted */
+static int flash_ports(char **ports, int nports, int doublerate, int retries, int wait,
+	const struct boot_config *cfg)
+{
+	struct image kernel, initrd;
+	struct port_job *jobs;
+	FILE *f;
+	int running;
+	int failed;
+	int i;
+
+	if(!load_image(&kernel, "kernel", cfg->kernel_image))
+		return nports;
+	if((cfg->initrd_image != NULL) && !load_image(&initrd, "initrd", cfg->initrd_image)) {
+		free_image(&kernel);
+		return nports;
+	}
+	jobs = calloc(nports, sizeof(struct port_job));
+	if(jobs == NULL) {
+		perror("[FLTERM] Unable to allocate memory");
+		return nports;
+	}
+
+	catch_termination();
+	printf("[FLTERM] Waiting for %d boards (%d retries each).\n", nports, retries);
+	for(i=0;i<nports;i++) {
+		jobs[i].port = ports[i];
+		jobs[i].doublerate = doublerate;
+		jobs[i].cfg = cfg;
+		jobs[i].kernel = &kernel;
+		jobs[i].initrd = cfg->initrd_image != NULL ? &initrd : NULL;
+		jobs[i].retries = retries;
+		jobs[i].wait = wait;
+		jobs[i].state = JOB_WAITING;
+		init_stats(&jobs[i].stats);
+		if(pthread_create(&jobs[i].thread, NULL, flash_port, &jobs[i]) == 0)
+			jobs[i].started = 1;
+		else {
+			fprintf(stderr, "[FLTERM %s] Unable to start thread.\n", ports[i]);
+			jobs[i].state = JOB_FAILED;
+			jobs[i].finished = 1;
+		}
+	}
+
+	do {
+		usleep(500000);
+		if(terminate) {
+			/* Interrupt sessions blocked in system calls */
+			for(i=0;i<nports;i++)
+				if(!jobs[i].finished)
+					pthread_kill(jobs[i].thread, SIGINT);
+		}
+		running = 0;
+		for(i=0;i<nports;i++)
+			if(!jobs[i].finished) running++;
+		if(isatty(1))
+			print_job_status(jobs, nports);
+	} while(running > 0);
+	for(i=0;i<nports;i++)
+		if(jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+
+	printf("\n[FLTERM] Summary:\n");
+	failed = 0;
+	for(i=0;i<nports;i++) {
+		printf("  %-20s %-7s %d attempt(s), %d frames retransmitted (%d CRC errors, %d timeouts), %.1fs\n",
+			jobs[i].port, jobs[i].state == JOB_BOOTED ? "booted" : "FAILED",
+			jobs[i].attempts, jobs[i].stats.retransmissions,
+			jobs[i].stats.crc_errors, jobs[i].stats.timeouts, jobs[i].elapsed);
+		if(jobs[i].state != JOB_BOOTED)
+			failed++;
+	}
+	if(failed > 0) {
+		printf("[FLTERM] %d of %d boards failed:", failed, nports);
+		for(i=0;i<nports;i++)
+			if(jobs[i].state != JOB_BOOTED)
+				printf(" %s", jobs[i].port);
+		printf("\n");
+	} else
+		printf("[FLTERM] All %d boards booted.\n", nports);
+	
+	if(cfg->stats_json != NULL) {
+		f = open_stats_json(cfg->stats_json);
+		if(f != NULL) {
+			fprintf(f, "{\n\"boards\": [\n");
+			for(i=0;i<nports;i++) {
+				print_stats_json(f, jobs[i].port, jobs[i].state == JOB_BOOTED,
+					jobs[i].session.baudrate, &jobs[i].stats);
+				fprintf(f, i < nports-1 ? ",\n" : "\n");
+			}
+			fprintf(f, "],\n\"failed\": %d\n}", failed);
+			close_stats_json(f);
+		}
+	}
+	for(i=0;i<nports;i++)
+		free_stats(&jobs[i].stats);
+
+	free(jobs);
+	if(cfg->initrd_image != NULL)
+		free_image(&initrd);
+	free_image(&kernel);
+	return failed;
 }
 
 enum {
 	OPTION_PORT,
 	OPTION_DOUBLERATE,
+	OPTION_SPEED,
+	OPTION_WINDOW,
+	OPTION_NOCOMPRESS,
+	OPTION_DELTA,
+	OPTION_VERIFY,
+	OPTION_RETRIES,
+	OPTION_WAIT,
+	OPTION_STATSJSON,
+	OPTION_DUMP,
+	OPTION_BATCH,
+	OPTION_DUMPADR,
+	OPTION_DUMPLENGTH,
 	OPTION_KERNEL,
 	OPTION_KERNELADR,
 	OPTION_CMDLINE,
@@ -389,6 +2440,66 @@ static const struct option options[] = {
 		.has_arg = 0,
 		.val = OPTION_DOUBLERATE
 	},
+	{
+		.name = "speed",
+		.has_arg = 1,
+		.val = OPTION_SPEED
+	},
+	{
+		.name = "window",
+		.has_arg = 1,
+		.val = OPTION_WINDOW
+	},
+	{
+		.name = "no-compress",
+		.has_arg = 0,
+		.val = OPTION_NOCOMPRESS
+	},
+	{
+		.name = "delta",
+		.has_arg = 0,
+		.val = OPTION_DELTA
+	},
+	{
+		.name = "verify",
+		.has_arg = 0,
+		.val = OPTION_VERIFY
+	},
+	{
+		.name = "retries",
+		.has_arg = 1,
+		.val = OPTION_RETRIES
+	},
+	{
+		.name = "wait",
+		.has_arg = 1,
+		.val = OPTION_WAIT
+	},
+	{
+		.name = "dump",
+		.has_arg = 1,
+		.val = OPTION_DUMP
+	},
+	{
+		.name = "batch",
+		.has_arg = 1,
+		.val = OPTION_BATCH
+	},
+	{
+		.name = "dump-adr",
+		.has_arg = 1,
+		.val = OPTION_DUMPADR
+	},
+	{
+		.name = "dump-length",
+		.has_arg = 1,
+		.val = OPTION_DUMPLENGTH
+	},
+	{
+		.name = "stats-json",
+		.has_arg = 1,
+		.val = OPTION_STATSJSON
+	},
 	{
 		.name = "kernel",
 		.has_arg = 1,
@@ -426,46 +2537,82 @@ static const struct option options[] = {
 
 static void print_usage()
 {
-	fprintf(stderr, "Serial boot program for the Milkymist SoC - v. 1.1\n");
+	fprintf(stderr, "Serial boot program for the Milkymist SoC - v. 1.2\n");
 	fprintf(stderr, "Copyright (C) 2007, 2008, 2009 Sebastien Bourdeauducq\n\n");
 
 	fprintf(stderr, "This program is free software: you can redistribute it and/or modify\n");
 	fprintf(stderr, "it under the terms of the GNU General Public License as published by\n");
 	fprintf(stderr, "the Free Software Foundation, version 3 of the License.\n\n");
 
-	fprintf(stderr, "Usage: flterm --port <port> [--double-rate]\n");
+	fprintf(stderr, "Usage: flterm --port <port> [--port <port>...] [--double-rate]\n");
+	fprintf(stderr, "              [--window <frames>] [--retries <n>] [--wait <seconds>]\n");
+	fprintf(stderr, "              [--speed <baud>] [--no-compress] [--delta]\n");
+	fprintf(stderr, "              [--verify] [--stats-json <file>]\n");
 	fprintf(stderr, "              --kernel <kernel_image> [--kernel-adr <address>]\n");
 	fprintf(stderr, "              [--cmdline <cmdline> [--cmdline-adr <address>]]\n");
-	fprintf(stderr, "              [--initrd <initrd_image> [--initrd-adr <address>]]\n\n");
+	fprintf(stderr, "              [--initrd <initrd_image> [--initrd-adr <address>]]\n");
+	fprintf(stderr, "   or: flterm --port <port> [--double-rate] --dump <file>\n");
+	fprintf(stderr, "              --dump-adr <address> --dump-length <bytes>\n");
+	fprintf(stderr, "   or: flterm --port <port> [--double-rate] --batch <file>\n\n");
 	printf("Default load addresses:\n");
 	fprintf(stderr, "  kernel:  0x%08x\n", DEFAULT_KERNELADR);
 	fprintf(stderr, "  cmdline: 0x%08x\n", DEFAULT_CMDLINEADR);
 	fprintf(stderr, "  initrd:  0x%08x\n", DEFAULT_INITRDADR);
+	fprintf(stderr, "Default window: %d frames (0 disables windowed transfers)\n", DEFAULT_WINDOW);
+	fprintf(stderr, "With --speed, the upload and the console that follows run at the given\n");
+	fprintf(stderr, "baud rate if the device accepts it. The device goes back to the\n");
+	fprintf(stderr, "default rate when it is reset.\n");
+	fprintf(stderr, "With several ports, all boards are booted in parallel without a terminal.\n");
+	fprintf(stderr, "Each port waits up to %d seconds (--wait) for a download request, and\n", DEFAULT_WAIT);
+	fprintf(stderr, "%d more times (--retries) after a failed session.\n", DEFAULT_RETRIES);
+	fprintf(stderr, "--verify checks the CRC32 of each image in the device memory before booting.\n");
+	fprintf(stderr, "--dump saves device memory to a file, using the mrb command of the BIOS\n");
+	fprintf(stderr, "shell, which must be at its prompt.\n");
+	fprintf(stderr, "--batch runs the memory operations listed in a file through the batch\n");
+	fprintf(stderr, "command of the BIOS shell, one per line: w <address> <value>,\n");
+	fprintf(stderr, "r <address> or c <destination> <source> <words>. Values read are printed.\n");
+	fprintf(stderr, "--stats-json writes link statistics after each session (- for stdout).\n");
 }
 
 int main(int argc, char *argv[])
 {
 	int opt;
-	char *serial_port;
+	char **ports;
+	int nports;
 	int doublerate;
-	char *kernel_image;
-	unsigned int kernel_address;
-	char *cmdline;
-	unsigned int cmdline_address;
-	char *initrd_image;
-	unsigned int initrd_address;
+	int retries;
+	int wait;
+	struct boot_config cfg;
 	char *endptr;
 	struct termios otty, ntty;
+	int failed;
+	const char *dump_file;
+	const char *batch_file;
+	unsigned int dump_address;
+	unsigned int dump_length;
 	
 	/* Fetch command line arguments */
-	serial_port = NULL;
+	ports = NULL;
+	nports = 0;
 	doublerate = 0;
-	kernel_image = NULL;
-	kernel_address = DEFAULT_KERNELADR;
-	cmdline = NULL;
-	cmdline_address = DEFAULT_CMDLINEADR;
-	initrd_image = NULL;
-	initrd_address = DEFAULT_INITRDADR;
+	retries = DEFAULT_RETRIES;
+	wait = DEFAULT_WAIT;
+	cfg.speed = 0;
+	cfg.window = DEFAULT_WINDOW;
+	cfg.compress = 1;
+	cfg.delta = 0;
+	cfg.verify = 0;
+	cfg.kernel_image = NULL;
+	cfg.kernel_address = DEFAULT_KERNELADR;
+	cfg.cmdline = NULL;
+	cfg.cmdline_address = DEFAULT_CMDLINEADR;
+	cfg.initrd_image = NULL;
+	cfg.initrd_address = DEFAULT_INITRDADR;
+	cfg.stats_json = NULL;
+	dump_file = NULL;
+	batch_file = NULL;
+	dump_address = 0;
+	dump_length = 0;
 	while((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
 		if(opt == '?') {
 			print_usage();
@@ -473,40 +2620,100 @@ int main(int argc, char *argv[])
 		}
 		switch(opt) {
 			case OPTION_PORT:
-				free(serial_port);
-				serial_port = strdup(optarg);
+				ports = realloc(ports, (nports+1)*sizeof(char *));
+				if(ports == NULL) return 1;
+				ports[nports++] = optarg;
 				break;
 			case OPTION_DOUBLERATE:
 				doublerate = 1;
 				break;
+			case OPTION_SPEED:
+				cfg.speed = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) cfg.speed = 0;
+				break;
+			case OPTION_WINDOW:
+				cfg.window = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) cfg.window = DEFAULT_WINDOW;
+				break;
+			case OPTION_NOCOMPRESS:
+				cfg.compress = 0;
+				break;
+			case OPTION_DELTA:
+				cfg.delta = 1;
+				break;
+			case OPTION_VERIFY:
+				cfg.verify = 1;
+				break;
+			case OPTION_RETRIES:
+				retries = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) retries = DEFAULT_RETRIES;
+				break;
+			case OPTION_WAIT:
+				wait = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) wait = DEFAULT_WAIT;
+				break;
+			case OPTION_STATSJSON:
+				cfg.stats_json = optarg;
+				break;
+			case OPTION_DUMP:
+				dump_file = optarg;
+				break;
+			case OPTION_BATCH:
+				batch_file = optarg;
+				break;
+			case OPTION_DUMPADR:
+				dump_address = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) dump_address = 0;
+				break;
+			case OPTION_DUMPLENGTH:
+				dump_length = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) dump_length = 0;
+				break;
 			case OPTION_KERNEL:
-				free(kernel_image);
-				kernel_image = strdup(optarg);
+				cfg.kernel_image = optarg;
 				break;
 			case OPTION_KERNELADR:
-				kernel_address = strtoul(optarg, &endptr, 0);
-				if(*endptr != 0) kernel_address = 0;
+				cfg.kernel_address = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) cfg.kernel_address = 0;
 				break;
 			case OPTION_CMDLINE:
-				free(cmdline);
-				cmdline = strdup(optarg);
+				cfg.cmdline = optarg;
 				break;
 			case OPTION_CMDLINEADR:
-				cmdline_address = strtoul(optarg, &endptr, 0);
-				if(*endptr != 0) cmdline_address = 0;
+				cfg.cmdline_address = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) cfg.cmdline_address = 0;
 				break;
 			case OPTION_INITRD:
-				free(initrd_image);
-				initrd_image = strdup(optarg);
+				cfg.initrd_image = optarg;
 				break;
 			case OPTION_INITRDADR:
-				initrd_address = strtoul(optarg, &endptr, 0);
-				if(*endptr != 0) initrd_address = 0;
+				cfg.initrd_address = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) cfg.initrd_address = 0;
 				break;
 		}
 	}
 
-	if((serial_port == NULL) || (kernel_image == NULL)) {
+	if(batch_file != NULL) {
+		if(nports != 1) {
+			print_usage();
+			return 1;
+		}
+		failed = !run_batch(ports[0], doublerate, batch_file);
+		free(ports);
+		return failed;
+	}
+
+	if(dump_file != NULL) {
+		if((nports != 1) || (dump_length == 0)) {
+			print_usage();
+			return 1;
+		}
+		failed = !dump_memory(ports[0], doublerate, dump_file, dump_address, dump_length);
+		free(ports);
+		return failed;
+	}
+
+	if((nports == 0) || (cfg.kernel_image == NULL)) {
 		print_usage();
 		return 1;
 	}
@@ -514,6 +2721,12 @@ int main(int argc, char *argv[])
 	/* Banner */
 	printf("[FLTERM] Starting...\n");
 	
+	if(nports > 1) {
+		failed = flash_ports(ports, nports, doublerate, retries, wait, &cfg);
+		free(ports);
+		return failed > 0 ? 1 : 0;
+	}
+	
 	/* Set up stdin/out */
 	tcgetattr(0, &otty);
 	ntty = otty;
@@ -521,13 +2734,11 @@ int main(int argc, char *argv[])
 	tcsetattr(0, TCSANOW, &ntty);
 	
 	/* Do the bulk of the work */
-	do_terminal(serial_port, doublerate,
-		kernel_image, kernel_address,
-		cmdline, cmdline_address,
-		initrd_image, initrd_address);
+	do_terminal(ports[0], doublerate, &cfg);
 	
 	/* Restore stdin/out into their previous state */
 	tcsetattr(0, TCSANOW, &otty);
 	
+	free(ports);
 	return 0;
 }
@@ -0,0 +1,22 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host build of the BIOS serial boot code, see sflemu.c */
+#include "../../software/include/console.h"
+
+/* Device messages go to the emulated serial port */
+int sflemu_printf(const char *fmt, ...);
+#define printf sflemu_printf
@@ -0,0 +1,25 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HW_UART_H
+#define __HW_UART_H
+
+/* The UART registers of the emulated device, see sflemu.c */
+extern unsigned int sflemu_uart_divisor;
+
+#define CSR_UART_DIVISOR	sflemu_uart_divisor
+
+#endif /* __HW_UART_H */
@@ -0,0 +1,131 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <lz4.h>
+
+/* Greedy single-probe LZ4 block compressor for the host tools */
+
+#define HASH_LOG	13
+#define MINMATCH	4
+#define MAX_OFFSET	65535
+/* The last match must start at least 12 bytes before the end of the
+ * block and the last 5 bytes are always literals.
+ */
+#define MFLIMIT		12
+#define LASTLITERALS	5
+
+static unsigned int read32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned int hash(const unsigned char *p)
+{
+	return (read32(p)*2654435761U) >> (32 - HASH_LOG);
+}
+
+static unsigned char *put_length(unsigned char *op, unsigned int length)
+{
+	while(length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = length;
+	return op;
+}
+
+/* Emits one sequence. A negative match length emits literals only. */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+	const unsigned char *literals, unsigned int nliterals,
+	unsigned int offset, int mlength)
+{
+	unsigned char *token;
+	unsigned int needed;
+
+	needed = 1 + nliterals + nliterals/255 + 1;
+	if(mlength >= 0)
+		needed += 2 + mlength/255 + 1;
+	if(needed > (unsigned int)(oend - op))
+		return NULL;
+
+	token = op++;
+	if(nliterals >= 15) {
+		*token = 15 << 4;
+		op = put_length(op, nliterals - 15);
+	} else
+		*token = nliterals << 4;
+	memcpy(op, literals, nliterals);
+	op += nliterals;
+
+	if(mlength >= 0) {
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		if(mlength >= 15) {
+			*token |= 15;
+			op = put_length(op, mlength - 15);
+		} else
+			*token |= mlength;
+	}
+	return op;
+}
+
+int lz4_compress(const unsigned char *src, int srclen, unsigned char *dst, int dstmax)
+{
+	int table[1 << HASH_LOG];
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	const unsigned char *iend = src + srclen;
+	const unsigned char *mflimit = iend - MFLIMIT;
+	const unsigned char *matchlimit = iend - LASTLITERALS;
+	const unsigned char *match;
+	unsigned char *op = dst;
+	unsigned char *oend = dst + dstmax;
+	unsigned int h;
+	int length;
+	int i;
+
+	for(i=0;i<(1 << HASH_LOG);i++)
+		table[i] = -1;
+
+	if(srclen > MFLIMIT) {
+		while(ip <= mflimit) {
+			h = hash(ip);
+			match = table[h] < 0 ? NULL : src + table[h];
+			table[h] = ip - src;
+			if((match == NULL) || (ip - match > MAX_OFFSET)
+			  || (read32(match) != read32(ip))) {
+				ip++;
+				continue;
+			}
+
+			length = MINMATCH;
+			while((ip + length < matchlimit) && (ip[length] == match[length]))
+				length++;
+
+			op = put_sequence(op, oend, anchor, ip - anchor, ip - match, length - MINMATCH);
+			if(op == NULL)
+				return 0;
+			ip += length;
+			anchor = ip;
+		}
+	}
+
+	op = put_sequence(op, oend, anchor, iend - anchor, 0, -1);
+	if(op == NULL)
+		return 0;
+	return op - dst;
+}
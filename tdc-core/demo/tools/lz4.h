@@ -0,0 +1,34 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LZ4_H
+#define __LZ4_H
+
+/*
+ * LZ4 block format (no frame header, no checksum).
+ * The decoder is shared between the BIOS and the host tools and
+ * needs no memory other than the destination buffer.
+ */
+
+/* Returns the compressed size, or 0 if it does not fit in dstmax bytes */
+int lz4_compress(const unsigned char *src, int srclen, unsigned char *dst, int dstmax);
+
+/* Returns the decompressed size, or -1 if the input is malformed
+ * or would not fit in dstlen bytes.
+ */
+int lz4_decompress(const unsigned char *src, int srclen, unsigned char *dst, int dstlen);
+
+#endif /* __LZ4_H */
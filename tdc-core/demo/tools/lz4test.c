@@ -0,0 +1,144 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Round-trip test of the host LZ4 compressor against the decoder
+ * used by the BIOS. Extra files given on the command line are
+ * tested as well.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <lz4.h>
+
+static int roundtrip(const char *name, const unsigned char *data, int length)
+{
+	unsigned char *compressed;
+	unsigned char *decompressed;
+	int max;
+	int clen;
+	int dlen;
+	int ok;
+
+	max = length + length/255 + 16;
+	compressed = malloc(max);
+	decompressed = malloc(length + 1);
+	ok = 1;
+
+	clen = lz4_compress(data, length, compressed, max);
+	if(clen <= 0) {
+		printf("FAIL %s: compression failed\n", name);
+		ok = 0;
+		goto out;
+	}
+	dlen = lz4_decompress(compressed, clen, decompressed, length);
+	if((dlen != length) || memcmp(data, decompressed, length)) {
+		printf("FAIL %s: round trip mismatch\n", name);
+		ok = 0;
+		goto out;
+	}
+	/* The decoder must refuse to overflow its output */
+	if((length > 0) && (lz4_decompress(compressed, clen, decompressed, length - 1) != -1)) {
+		printf("FAIL %s: output overflow not detected\n", name);
+		ok = 0;
+		goto out;
+	}
+	/* Truncated input must never produce the full output */
+	if((clen > 1) && (lz4_decompress(compressed, clen - 1, decompressed, length) == length)) {
+		printf("FAIL %s: truncated input not detected\n", name);
+		ok = 0;
+		goto out;
+	}
+	printf("OK   %s: %d -> %d bytes\n", name, length, clen);
+out:
+	free(decompressed);
+	free(compressed);
+	return ok;
+}
+
+static int roundtrip_file(const char *name)
+{
+	int fd;
+	int length;
+	unsigned char *data;
+	int ok;
+
+	fd = open(name, O_RDONLY);
+	if(fd == -1) {
+		perror(name);
+		return 0;
+	}
+	length = lseek(fd, 0, SEEK_END);
+	lseek(fd, 0, SEEK_SET);
+	data = malloc(length + 1);
+	if(read(fd, data, length) != length) {
+		perror(name);
+		close(fd);
+		free(data);
+		return 0;
+	}
+	close(fd);
+	ok = roundtrip(name, data, length);
+	free(data);
+	return ok;
+}
+
+#define TEST_SIZE 70000
+
+int main(int argc, char *argv[])
+{
+	unsigned char *data;
+	int ok;
+	int i;
+
+	data = malloc(TEST_SIZE);
+	ok = 1;
+
+	data[0] = 0x5a;
+	ok &= roundtrip("empty", data, 0);
+	ok &= roundtrip("one byte", data, 1);
+
+	memset(data, 0, TEST_SIZE);
+	ok &= roundtrip("zeros", data, TEST_SIZE);
+
+	srand(1);
+	for(i=0;i<TEST_SIZE;i++)
+		data[i] = rand();
+	ok &= roundtrip("random", data, TEST_SIZE);
+	ok &= roundtrip("random short", data, 13);
+
+	for(i=0;i<TEST_SIZE;i++)
+		data[i] = "Milkymist SoC TDC demo "[i % 23];
+	ok &= roundtrip("text", data, TEST_SIZE);
+
+	/* Code-like data followed by zero padding */
+	for(i=0;i<TEST_SIZE/2;i++)
+		data[i] = (rand() % 4) ? (i & 0xff) : rand();
+	memset(&data[TEST_SIZE/2], 0, TEST_SIZE/2);
+	ok &= roundtrip("mixed", data, TEST_SIZE);
+
+	free(data);
+
+	for(i=1;i<argc;i++)
+		ok &= roundtrip_file(argv[i]);
+
+	return ok ? 0 : 1;
+}
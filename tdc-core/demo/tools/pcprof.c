@@ -0,0 +1,277 @@
+/*
+ * Milkymist SoC
+ * Copyright (C) 2007, 2008, 2009 Sebastien Bourdeauducq
+ * Copyright (C) 2011 CERN
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Flat profile from the histogram printed by the BIOS "pcprof" command
+ * (in BIOSes built with BENCH=1), e.g. copied from the flterm session,
+ * against the symbols of bios.elf.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SHT_SYMTAB	2
+#define SHF_EXECINSTR	0x4
+#define STT_NOTYPE	0
+#define STT_FUNC	2
+
+struct symbol {
+	unsigned int address;
+	const char *name;
+	unsigned int samples;
+};
+
+static unsigned char *elf;
+static long elf_length;
+static int big_endian;
+
+static struct symbol *symbols;
+static int nsymbols;
+
+static unsigned int get16(unsigned int offset)
+{
+	if(big_endian)
+		return (elf[offset] << 8) | elf[offset+1];
+	return elf[offset] | (elf[offset+1] << 8);
+}
+
+static unsigned int get32(unsigned int offset)
+{
+	if(big_endian)
+		return ((unsigned int)elf[offset] << 24) | (elf[offset+1] << 16)
+			| (elf[offset+2] << 8) | elf[offset+3];
+	return elf[offset] | (elf[offset+1] << 8) | (elf[offset+2] << 16)
+		| ((unsigned int)elf[offset+3] << 24);
+}
+
+static int load_file(const char *filename)
+{
+	FILE *fd;
+
+	fd = fopen(filename, "rb");
+	if(!fd) {
+		perror("Unable to open ELF file");
+		return 0;
+	}
+	fseek(fd, 0, SEEK_END);
+	elf_length = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	elf = malloc(elf_length + 1);
+	if((elf == NULL) || (fread(elf, 1, elf_length, fd) != elf_length)) {
+		fprintf(stderr, "Unable to read ELF file\n");
+		fclose(fd);
+		return 0;
+	}
+	fclose(fd);
+	/* Terminates the last string table */
+	elf[elf_length] = 0;
+	return 1;
+}
+
+static int compare_address(const void *a, const void *b)
+{
+	const struct symbol *sa = a, *sb = b;
+
+	if(sa->address != sb->address)
+		return sa->address < sb->address ? -1 : 1;
+	return strcmp(sa->name, sb->name);
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	const struct symbol *sa = a, *sb = b;
+
+	if(sa->samples != sb->samples)
+		return sa->samples > sb->samples ? -1 : 1;
+	return compare_address(a, b);
+}
+
+/* Functions and labels of the executable sections */
+static int load_symbols()
+{
+	unsigned int shoff, shentsize, shnum;
+	unsigned int sh, sym, symoff, symsize, strsh, stroff, link;
+	unsigned int name, info, shndx;
+	int i;
+
+	if((elf_length < 52) || (memcmp(elf, "\177ELF", 4) != 0) || (elf[4] != 1)) {
+		fprintf(stderr, "Not a 32-bit ELF file\n");
+		return 0;
+	}
+	big_endian = elf[5] == 2;
+	shoff = get32(0x20);
+	shentsize = get16(0x2e);
+	shnum = get16(0x30);
+	if((shentsize < 40) || ((unsigned long)shoff + shnum*shentsize > elf_length)) {
+		fprintf(stderr, "Corrupted section headers\n");
+		return 0;
+	}
+
+	sh = 0;
+	for(i=0;i<shnum;i++) {
+		sh = shoff + i*shentsize;
+		if(get32(sh + 4) == SHT_SYMTAB)
+			break;
+	}
+	if(i == shnum) {
+		fprintf(stderr, "No symbol table, was the file stripped?\n");
+		return 0;
+	}
+	symoff = get32(sh + 16);
+	symsize = get32(sh + 20);
+	link = get32(sh + 24);
+	if(((unsigned long)symoff + symsize > elf_length) || (link >= shnum)) {
+		fprintf(stderr, "Corrupted symbol table\n");
+		return 0;
+	}
+	strsh = shoff + link*shentsize;
+	stroff = get32(strsh + 16);
+	if((unsigned long)stroff + get32(strsh + 20) > elf_length) {
+		fprintf(stderr, "Corrupted string table\n");
+		return 0;
+	}
+
+	symbols = calloc(symsize/16 + 1, sizeof(struct symbol));
+	if(symbols == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	nsymbols = 0;
+	for(sym=symoff;sym+16<=symoff+symsize;sym+=16) {
+		name = get32(sym);
+		info = elf[sym + 12];
+		shndx = get16(sym + 14);
+		if((name == 0) || (shndx == 0) || (shndx >= shnum))
+			continue;
+		if(((info & 0xf) != STT_FUNC) && ((info & 0xf) != STT_NOTYPE))
+			continue;
+		if(!(get32(shoff + shndx*shentsize + 8) & SHF_EXECINSTR))
+			continue;
+		if(stroff + name >= elf_length)
+			continue;
+		symbols[nsymbols].address = get32(sym + 4);
+		symbols[nsymbols].name = (const char *)elf + stroff + name;
+		nsymbols++;
+	}
+	if(nsymbols == 0) {
+		fprintf(stderr, "No code symbols\n");
+		return 0;
+	}
+	qsort(symbols, nsymbols, sizeof(struct symbol), compare_address);
+	return 1;
+}
+
+/* Last symbol at or below the address, NULL below the first one */
+static struct symbol *find_symbol(unsigned int address)
+{
+	int low, high, mid;
+
+	if(address < symbols[0].address)
+		return NULL;
+	low = 0;
+	high = nsymbols - 1;
+	while(low < high) {
+		mid = (low + high + 1)/2;
+		if(symbols[mid].address <= address)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	/* Labels sharing the address: count on the first one */
+	while((low > 0) && (symbols[low-1].address == symbols[low].address))
+		low--;
+	return &symbols[low];
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *fd;
+	char line[256];
+	unsigned int base, shift, samples, outside;
+	unsigned int address, count, unknown, total;
+	int in_dump, found;
+	struct symbol *s;
+	int i;
+
+	if(argc != 3) {
+		fprintf(stderr, "Usage: pcprof <bios.elf> <dump file|->\n");
+		return 1;
+	}
+	if(!load_file(argv[1]) || !load_symbols())
+		return 1;
+
+	if(strcmp(argv[2], "-") == 0)
+		fd = stdin;
+	else {
+		fd = fopen(argv[2], "r");
+		if(!fd) {
+			perror("Unable to open dump file");
+			return 1;
+		}
+	}
+
+	/* A session log may hold several dumps, the last one is used */
+	in_dump = 0;
+	found = 0;
+	base = shift = samples = outside = 0;
+	unknown = 0;
+	while(fgets(line, sizeof(line), fd) != NULL) {
+		if(sscanf(line, "pcprof base %x shift %u samples %u outside %u",
+			&base, &shift, &samples, &outside) == 4) {
+			for(i=0;i<nsymbols;i++)
+				symbols[i].samples = 0;
+			unknown = 0;
+			in_dump = 1;
+			found = 1;
+		} else if(strncmp(line, "pcprof end", 10) == 0)
+			in_dump = 0;
+		else if(in_dump && (sscanf(line, "%x %u", &address, &count) == 2)) {
+			s = find_symbol(address);
+			if(s != NULL)
+				s->samples += count;
+			else
+				unknown += count;
+		}
+	}
+	if(fd != stdin)
+		fclose(fd);
+	if(!found) {
+		fprintf(stderr, "No pcprof dump found\n");
+		return 1;
+	}
+
+	total = unknown;
+	for(i=0;i<nsymbols;i++)
+		total += symbols[i].samples;
+	printf("%u samples in %u-byte buckets, %u outside of base 0x%08x\n",
+		samples, 1 << shift, outside, base);
+	if(shift > 2)
+		printf("Buckets spanning several symbols count on the first one\n");
+	if(total == 0)
+		return 0;
+
+	qsort(symbols, nsymbols, sizeof(struct symbol), compare_samples);
+	printf("  %%time   samples  symbol\n");
+	for(i=0;(i<nsymbols) && (symbols[i].samples != 0);i++)
+		printf("%7.2f %9u  %s\n", 100.0*symbols[i].samples/total,
+			symbols[i].samples, symbols[i].name);
+	if(unknown != 0)
+		printf("%7.2f %9u  (no symbol)\n", 100.0*unknown/total, unknown);
+	return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef __linux__
+
+/* termios2 lives in the kernel headers, which clash with <termios.h>,
+ * hence this separate file.
+ */
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+#include <serial.h>
+
+int set_serial_speed(int fd, int baudrate)
+{
+	struct termios2 tio;
+
+	if(ioctl(fd, TCGETS2, &tio) < 0)
+		return -1;
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_ispeed = baudrate;
+	tio.c_ospeed = baudrate;
+	tio.c_cflag &= ~(CBAUD << IBSHIFT);
+	tio.c_cflag |= BOTHER << IBSHIFT;
+	if(ioctl(fd, TCSETS2, &tio) < 0)
+		return -1;
+	return 0;
+}
+
+#else
+
+#include <termios.h>
+
+#include <serial.h>
+
+int set_serial_speed(int fd, int baudrate)
+{
+	struct termios tio;
+
+	if(tcgetattr(fd, &tio) < 0)
+		return -1;
+	/* Standard rates only, unless the platform takes plain numbers */
+	if(cfsetspeed(&tio, baudrate) < 0)
+		return -1;
+	return tcsetattr(fd, TCSANOW, &tio);
+}
+
+#endif
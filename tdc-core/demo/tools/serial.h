@@ -0,0 +1,26 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __SERIAL_H
+#define __SERIAL_H
+
+/* Sets both directions of a serial port to an arbitrary baud rate.
+ * Returns 0 on success and -1 on error.
+ */
+int set_serial_speed(int fd, int baudrate);
+
+#endif /* __SERIAL_H */
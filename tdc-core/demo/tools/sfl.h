@@ -22,13 +22,40 @@
 #define SFL_MAGIC_REQ "sL5DdSMmkekro\n"
 #define SFL_MAGIC_ACK "z6IHG7cYDID6o\n"
 
+/* Maximum payload of a classic frame */
+#define SFL_PAYLOAD_CLASSIC	255
+/* Maximum payload of a large frame: 4KB of data plus a load address */
+#define SFL_PAYLOAD_MAX		(4096+4)
+
+/*
+ * In classic mode, frames are sent as length, crc, cmd, payload and the
+ * CRC covers cmd and payload. Once the windowed mode has been negotiated
+ * with SFL_CMD_HELLO, frames are sent as length, hcrc, crc, seq, cmd,
+ * payload, and the CRC covers seq as well.
+ * The length is sent as a single byte, or as two bytes (big endian) when
+ * large frames have been negotiated. It is not covered by the CRC.
+ * The header CRC (hcrc) covers the length as 16 bits, seq, cmd and the
+ * first SFL_HEADER_PAYLOAD bytes of the payload, which hold the address
+ * of LOAD frames. The device checks it before receiving the rest, so
+ * that it can write the data of LOAD frames straight to memory.
+ */
+#define SFL_HEADER_PAYLOAD	4
+
 struct sfl_frame {
-	unsigned char length;
+	unsigned short length;
+	unsigned char hcrc[2];
 	unsigned char crc[2];
+	unsigned char seq;
 	unsigned char cmd;
-	unsigned char payload[255];
+	unsigned char payload[SFL_PAYLOAD_MAX];
 } __attribute__((packed));
 
+/*
+ * Maximum number of frames the host may send before it gets the
+ * acknowledgement of the first one.
+ */
+#define SFL_WINDOW_MAX		32
+
 /* General commands */
 #define SFL_CMD_ABORT		0x00
 #define SFL_CMD_LOAD		0x01
@@ -39,10 +66,130 @@ struct sfl_frame {
 #define SFL_CMD_INITRDSTART	0x04
 #define SFL_CMD_INITRDEND	0x05
 
-/* Replies */
+/* Session negotiation
+ * payload: requested features, requested window size
+ * reply:   SFL_ACK_SUCCESS, accepted features, accepted window size
+ * Older BIOSes reply SFL_ACK_UNKNOWN and stay in classic mode.
+ */
+#define SFL_CMD_HELLO		0x06
+
+/* Features */
+#define SFL_FEATURE_WINDOW	0x01
+#define SFL_FEATURE_LARGE	0x02	/* only granted with SFL_FEATURE_WINDOW */
+#define SFL_FEATURE_COMPRESS	0x04
+#define SFL_FEATURE_CRC32	0x08
+#define SFL_FEATURE_FILL	0x10
+#define SFL_FEATURE_BAUD	0x20
+#define SFL_FEATURE_SELECTIVE	0x40	/* with SFL_FEATURE_WINDOW, see below */
+
+/* LZ4 block decompressed at the given address
+ * payload: address, decompressed length (both 32-bit big endian), data
+ * The device replies SFL_ACK_ERROR if the block does not decompress
+ * to exactly the given length.
+ */
+#define SFL_CMD_LOAD_COMPRESSED	0x07
+
+/* CRC32 of a memory range
+ * payload: address, length (both 32-bit big endian)
+ * reply:   SFL_ACK_DATA with the CRC32 (32-bit big endian)
+ */
+#define SFL_CMD_CRC32		0x08
+
+/* Memory range set to a single value
+ * payload: address, length (both 32-bit big endian), value (8-bit)
+ */
+#define SFL_CMD_FILL		0x09
+
+/* Baud rate change
+ * payload: requested baud rate (32-bit big endian)
+ * reply:   SFL_ACK_DATA with the baud rate the device actually uses
+ *          (32-bit big endian), or 0 if it cannot get close enough.
+ * After a non-zero reply, the device switches to the new rate and
+ * waits for the host to send SFL_BAUD_CONFIRM at that rate. It echoes
+ * the string and keeps the new rate, or goes back to the previous
+ * rate if the string does not arrive in time.
+ */
+#define SFL_CMD_BAUD		0x0a
+
+#define SFL_BAUD_CONFIRM_LEN	8
+#define SFL_BAUD_CONFIRM	"fB4ud0k\n"
+
+/* Replies
+ * In windowed mode, each reply byte is followed by the sequence number
+ * of the frame it refers to. SFL_ACK_CRCERROR is followed by the
+ * sequence number the device expects next, and is only sent once the
+ * device has discarded the rest of the window. Afterwards, the device
+ * drops the frames numbered past the one it expects, and runs the older
+ * ones again.
+ *
+ * With SFL_FEATURE_SELECTIVE, the device also runs the frames numbered
+ * less than SFL_WINDOW_MAX past the one it expects, and each reply only
+ * acknowledges its own frame. JUMP, ABORT, BAUD and HELLO frames still
+ * wait for all older frames: the device replies SFL_ACK_RESEND to them
+ * until then. The host must not have frames in flight whose order
+ * matters otherwise, such as a CRC32 query over memory being loaded.
+ */
 #define SFL_ACK_SUCCESS		'K'
 #define SFL_ACK_CRCERROR	'C'
+/* Sent as soon as a frame with a damaged header is received, when
+ * SFL_FEATURE_SELECTIVE has been negotiated, followed by the sequence
+ * number the device expects next. The host should stop sending, and
+ * discard the data it has not sent yet, until the SFL_ACK_CRCERROR that
+ * follows.
+ */
+#define SFL_ACK_HOLD		'H'
+/* Sent instead of SFL_ACK_CRCERROR when only the payload of a frame is
+ * damaged, when SFL_FEATURE_SELECTIVE has been negotiated, followed by
+ * the sequence number of that frame. The device keeps receiving the
+ * frames that follow, and the host only sends that frame again.
+ */
+#define SFL_ACK_RESEND		'R'
 #define SFL_ACK_UNKNOWN		'U'
+/* The command failed, or its payload is too short for its fields */
 #define SFL_ACK_ERROR		'E'
+/* Success, followed by the data length (16-bit big endian), the CRC16
+ * of the data and the data itself (after the sequence number in
+ * windowed mode).
+ */
+#define SFL_ACK_DATA		'D'
+
+/* Binary memory dump, sent by the "mrb" command of the BIOS shell
+ * outside of serial boot sessions. The device sends SFL_DUMP_MAGIC,
+ * then one SFL_DUMP_DATA record per chunk of up to SFL_DUMP_CHUNK
+ * bytes, then SFL_DUMP_END.
+ * SFL_DUMP_DATA: address (32-bit), length (16-bit), data, and the
+ *                CRC16 of the address, length and data.
+ * SFL_DUMP_END:  CRC32 of the whole range.
+ * All fields are big endian.
+ */
+#define SFL_DUMP_MAGIC_LEN	8
+#define SFL_DUMP_MAGIC		"mRbDuMp\n"
+#define SFL_DUMP_CHUNK		1024
+#define SFL_DUMP_DATA		'D'
+#define SFL_DUMP_END		'E'
+
+/* Batched memory operations, run by the "batch" command of the BIOS
+ * shell. The device sends SFL_BATCH_MAGIC, then waits for packets made
+ * of the length of an operation list (16-bit, at most SFL_BATCH_MAX),
+ * its CRC16 and the list. It runs the whole list and replies with
+ * SFL_ACK_DATA followed by the words read, in the same format as in
+ * serial boot sessions without windowing. A list with an invalid
+ * operation is not run at all and gets SFL_ACK_ERROR; a damaged packet
+ * gets SFL_ACK_CRCERROR. An empty list leaves the batch mode.
+ * A header with both fields set to SFL_BATCH_REPEAT asks for the reply
+ * to the last list again, so that a damaged reply does not require
+ * running the list twice; it gets SFL_ACK_CRCERROR if that list was not
+ * run.
+ * All fields are big endian, addresses and values are 32-bit.
+ */
+#define SFL_BATCH_MAGIC_LEN	8
+#define SFL_BATCH_MAGIC		"bAtChGo\n"
+/* The device keeps a list and its reply in the serial boot frame buffer */
+#define SFL_BATCH_MAX		1024
+#define SFL_BATCH_REPEAT	0xffff
+
+#define SFL_BATCH_WRITE		'w' /* address, value */
+#define SFL_BATCH_READ		'r' /* address, the value goes to the reply */
+#define SFL_BATCH_COPY		'c' /* destination, source, number of words */
 
 #endif /* __SFL_H */
@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# Uploads an image to the serial boot emulator (sflemu) with several
+# flterm configurations, checks that it arrived intact and reports the
+# upload speed of each configuration.
+#
+# Usage: sflbench.sh [image] [sflemu options...]
+# Without an image, a 128KB test image made of code-like data, text and
+# zeros is generated.
+# The exit status is non-zero if any upload failed.
+
+cd "$(dirname "$0")"
+
+TMP=$(mktemp -d)
+trap 'rm -rf $TMP' EXIT
+
+if [ -f "$1" ]; then
+	IMAGE=$1
+	shift
+else
+	IMAGE=$TMP/image.bin
+	(
+		head -c 49152 /dev/urandom
+		for i in $(seq 1 1500); do echo "line $i of the test image"; done | head -c 32768
+		head -c 32768 /dev/zero
+		head -c 16384 /dev/urandom
+	) > $IMAGE
+fi
+
+CONFIGS=(
+	"--window 0 --no-compress"
+	"--no-compress"
+	""
+	"--speed 1000000"
+)
+
+FAILED=0
+for CONFIG in "${CONFIGS[@]}"; do
+	./sflemu --link $TMP/port --expect $IMAGE "$@" > /dev/null 2> $TMP/emu.log &
+	EMU=$!
+	while [ ! -e $TMP/port ]; do sleep 0.1; done
+	# flterm leaves when the emulator closes the port after the jump
+	./flterm --port $TMP/port --kernel $IMAGE $CONFIG < /dev/null > $TMP/flterm.log 2>&1 &
+	FLTERM=$!
+	if wait $EMU; then
+		wait $FLTERM
+		RESULT=$(tr '\r' '\n' < $TMP/flterm.log | grep "Upload complete" | sed 's/.*(\(.*\)).*/\1/')
+		echo "OK    ${CONFIG:-(defaults)}: $RESULT"
+	else
+		echo "FAIL  ${CONFIG:-(defaults)}"
+		cat $TMP/emu.log
+		FAILED=1
+		kill $FLTERM 2> /dev/null
+		wait $FLTERM 2> /dev/null
+	fi
+	rm -f $TMP/port
+done
+exit $FAILED
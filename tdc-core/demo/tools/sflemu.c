@@ -0,0 +1,507 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Serial boot device emulator.
+ * Runs the serialboot() code of the BIOS (software/bios/boot.c, built
+ * with SFL_EMULATOR) on the host, against a pseudo-terminal and a RAM
+ * image mapped at the device addresses, so that flterm can be tested
+ * and benchmarked without a board.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <pty.h>
+#include <getopt.h>
+
+#include <uart.h>
+#include <irq.h>
+#include <board.h>
+#include <timer.h>
+#include <hw/uart.h>
+
+#include "../software/bios/boot.h"
+
+#define DEFAULT_RAMADR		(0x40000000)
+#define DEFAULT_RAMSIZE		(32*1024*1024)
+#define DEFAULT_BAUDRATE	115200
+
+static const struct board_desc emulated_board = {
+	.id = 0x53504543, /* SPEC */
+	.name = "SPEC (emulated)",
+	.clk_frequency = 125000000,
+};
+
+const struct board_desc *brd_desc = &emulated_board;
+
+unsigned int sflemu_uart_divisor;
+
+static int masterfd;
+static int pacing;
+static double error_rate;
+static int frame_delay;
+static const char *expect_image;
+static unsigned int expect_address;
+static const char *link_name;
+
+/* As much as the receive ring of the BIOS UART driver; the rest stays
+ * in the pseudo-terminal, where the host can still discard it.
+ */
+static unsigned char rxbuf[512];
+static int rxlen;
+static int rxpos;
+static double rx_next;
+static double tx_next;
+static int reading;
+
+static long long received;
+static long long sent;
+static int injected;
+static double start;
+
+static double now()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+/* Keeps one direction of the line from going faster than the baud rate
+ * programmed into the emulated UART.
+ */
+static void pace(double *next)
+{
+	double t;
+
+	if(!pacing) return;
+	t = now();
+	if(*next < t) *next = t;
+	*next += 10.0*16.0*sflemu_uart_divisor/brd_desc->clk_frequency;
+	/* Sleep by chunks, usleep() is not precise enough for single bytes */
+	if(*next - t > 0.001)
+		usleep((*next - t)*1000000.0);
+}
+
+void writechar(char c)
+{
+	/* The processing delay is applied once per frame, when the
+	 * device starts replying after having received data.
+	 */
+	if(reading && (frame_delay > 0))
+		usleep(frame_delay);
+	reading = 0;
+	pace(&tx_next);
+	if(write(masterfd, &c, 1) != 1) {
+		fprintf(stderr, "[SFLEMU] Host went away.\n");
+		exit(2);
+	}
+	sent++;
+}
+
+char readchar()
+{
+	struct pollfd pfd;
+	unsigned char c;
+
+	if(rxpos == rxlen) {
+		pfd.fd = masterfd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, -1) < 0) goto fail;
+		rxlen = read(masterfd, rxbuf, sizeof(rxbuf));
+		if(rxlen <= 0) goto fail;
+		rxpos = 0;
+	}
+	pace(&rx_next);
+	c = rxbuf[rxpos++];
+	received++;
+	reading = 1;
+	if((error_rate > 0.0) && (drand48() < error_rate)) {
+		c ^= 1 << (lrand48() & 7);
+		injected++;
+	}
+	return c;
+
+fail:
+	fprintf(stderr, "[SFLEMU] Host went away.\n");
+	exit(2);
+}
+
+int readchar_nonblock()
+{
+	struct pollfd pfd;
+
+	if(rxpos < rxlen)
+		return 1;
+	pfd.fd = masterfd;
+	pfd.events = POLLIN;
+	return (poll(&pfd, 1, 0) > 0) && (pfd.revents & POLLIN);
+}
+
+/* The emulated UART is always synchronous and there are no interrupts */
+void uart_force_sync(int f)
+{
+}
+
+void irq_enable(unsigned int en)
+{
+}
+
+void irq_setmask(unsigned int mask)
+{
+}
+
+/* Windows are measured in milliseconds of host time */
+void timer_window_start(struct timer_window *w, unsigned int ms)
+{
+	w->start = (unsigned int)(long long)(now()*1000.0);
+	w->length = ms;
+}
+
+int timer_window_expired(struct timer_window *w)
+{
+	return (unsigned int)(long long)(now()*1000.0) - w->start >= w->length;
+}
+
+void putsnonl(const char *s)
+{
+	while(*s) {
+		writechar(*s);
+		s++;
+	}
+}
+
+int sflemu_printf(const char *fmt, ...)
+{
+	va_list args;
+	char buffer[512];
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buffer, sizeof(buffer), fmt, args);
+	va_end(args);
+	putsnonl(buffer);
+	fprintf(stderr, "[SFLEMU] Device: %s", buffer);
+	return len;
+}
+
+static int check_image(const char *name, unsigned int address)
+{
+	int fd;
+	struct stat st;
+	unsigned char *data;
+	int r;
+
+	fd = open(name, O_RDONLY);
+	if(fd == -1) {
+		perror("[SFLEMU] Unable to open expected image");
+		return 0;
+	}
+	fstat(fd, &st);
+	data = malloc(st.st_size+1);
+	if((data == NULL) || (read(fd, data, st.st_size) != st.st_size)) {
+		perror("[SFLEMU] Unable to read expected image");
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	r = memcmp(data, (void *)(unsigned long)address, st.st_size) == 0;
+	free(data);
+	return r;
+}
+
+void boot(unsigned int r1, unsigned int r2, unsigned int r3, unsigned int addr)
+{
+	double elapsed;
+	int ok;
+
+	elapsed = now() - start;
+	fprintf(stderr, "[SFLEMU] Jump to 0x%08x (cmdline 0x%08x, initrd 0x%08x-0x%08x).\n",
+		addr, r1, r2, r3);
+	fprintf(stderr, "[SFLEMU] %lld bytes received, %lld sent, %d errors injected in %.2fs (%.1fKB/s received).\n",
+		received, sent, injected, elapsed, received/(elapsed*1024.0));
+	ok = 1;
+	if(expect_image != NULL) {
+		ok = check_image(expect_image, expect_address);
+		fprintf(stderr, "[SFLEMU] Memory %s the expected image.\n", ok ? "matches" : "DOES NOT MATCH");
+	}
+	/* Let the host read the last acknowledgement */
+	usleep(200000);
+	if(link_name != NULL)
+		unlink(link_name);
+	exit(ok ? 0 : 1);
+}
+
+static int load_file(const char *name, unsigned int address, unsigned int limit)
+{
+	int fd;
+	int r;
+
+	fd = open(name, O_RDONLY);
+	if(fd == -1) {
+		perror("[SFLEMU] Unable to open preload image");
+		return 0;
+	}
+	r = read(fd, (void *)(unsigned long)address, limit);
+	close(fd);
+	if(r < 0) {
+		perror("[SFLEMU] Unable to read preload image");
+		return 0;
+	}
+	return 1;
+}
+
+enum {
+	OPTION_RAMADR,
+	OPTION_RAMSIZE,
+	OPTION_BAUDRATE,
+	OPTION_NOPACING,
+	OPTION_ERRORRATE,
+	OPTION_FRAMEDELAY,
+	OPTION_SEED,
+	OPTION_PRELOAD,
+	OPTION_EXPECT,
+	OPTION_EXPECTADR,
+	OPTION_LINK
+};
+
+static const struct option options[] = {
+	{
+		.name = "ram-adr",
+		.has_arg = 1,
+		.val = OPTION_RAMADR
+	},
+	{
+		.name = "ram-size",
+		.has_arg = 1,
+		.val = OPTION_RAMSIZE
+	},
+	{
+		.name = "baud",
+		.has_arg = 1,
+		.val = OPTION_BAUDRATE
+	},
+	{
+		.name = "no-pacing",
+		.has_arg = 0,
+		.val = OPTION_NOPACING
+	},
+	{
+		.name = "error-rate",
+		.has_arg = 1,
+		.val = OPTION_ERRORRATE
+	},
+	{
+		.name = "frame-delay",
+		.has_arg = 1,
+		.val = OPTION_FRAMEDELAY
+	},
+	{
+		.name = "seed",
+		.has_arg = 1,
+		.val = OPTION_SEED
+	},
+	{
+		.name = "preload",
+		.has_arg = 1,
+		.val = OPTION_PRELOAD
+	},
+	{
+		.name = "expect",
+		.has_arg = 1,
+		.val = OPTION_EXPECT
+	},
+	{
+		.name = "expect-adr",
+		.has_arg = 1,
+		.val = OPTION_EXPECTADR
+	},
+	{
+		.name = "link",
+		.has_arg = 1,
+		.val = OPTION_LINK
+	},
+	{
+		.name = NULL
+	}
+};
+
+static void print_usage()
+{
+	fprintf(stderr, "Serial boot device emulator for the Milkymist SoC\n\n");
+
+	fprintf(stderr, "This program is free software: you can redistribute it and/or modify\n");
+	fprintf(stderr, "it under the terms of the GNU General Public License as published by\n");
+	fprintf(stderr, "the Free Software Foundation, version 3 of the License.\n\n");
+
+	fprintf(stderr, "Usage: sflemu [--ram-adr <address>] [--ram-size <bytes>]\n");
+	fprintf(stderr, "              [--baud <rate>] [--no-pacing]\n");
+	fprintf(stderr, "              [--error-rate <probability>] [--seed <seed>]\n");
+	fprintf(stderr, "              [--frame-delay <microseconds>]\n");
+	fprintf(stderr, "              [--preload <image>]\n");
+	fprintf(stderr, "              [--expect <image> [--expect-adr <address>]]\n");
+	fprintf(stderr, "              [--link <path>]\n\n");
+	fprintf(stderr, "The emulated RAM is at 0x%08x (%d bytes) by default.\n", DEFAULT_RAMADR, DEFAULT_RAMSIZE);
+	fprintf(stderr, "--error-rate is the probability that a received byte gets a bit flipped.\n");
+	fprintf(stderr, "--frame-delay is added each time the device starts replying.\n");
+	fprintf(stderr, "--preload fills the RAM before the session, --expect compares it\n");
+	fprintf(stderr, "with an image when the host sends the jump command.\n");
+	fprintf(stderr, "Exit status: 0 after a boot, 1 if the memory does not match,\n");
+	fprintf(stderr, "2 if the serial boot failed.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	char *endptr;
+	unsigned int ram_address;
+	unsigned int ram_size;
+	int baudrate;
+	long seed;
+	const char *preload_image;
+	int slavefd;
+	char slave_name[64];
+	struct termios tio;
+	struct pollfd pfd;
+	void *ram;
+
+	ram_address = DEFAULT_RAMADR;
+	ram_size = DEFAULT_RAMSIZE;
+	baudrate = DEFAULT_BAUDRATE;
+	pacing = 1;
+	error_rate = 0.0;
+	frame_delay = 0;
+	seed = 1;
+	preload_image = NULL;
+	expect_image = NULL;
+	expect_address = DEFAULT_RAMADR;
+	link_name = NULL;
+	while((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		if(opt == '?') {
+			print_usage();
+			return 1;
+		}
+		switch(opt) {
+			case OPTION_RAMADR:
+				ram_address = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) ram_address = DEFAULT_RAMADR;
+				break;
+			case OPTION_RAMSIZE:
+				ram_size = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) ram_size = DEFAULT_RAMSIZE;
+				break;
+			case OPTION_BAUDRATE:
+				baudrate = strtoul(optarg, &endptr, 0);
+				if((*endptr != 0) || (baudrate <= 0)) baudrate = DEFAULT_BAUDRATE;
+				break;
+			case OPTION_NOPACING:
+				pacing = 0;
+				break;
+			case OPTION_ERRORRATE:
+				error_rate = strtod(optarg, &endptr);
+				if(*endptr != 0) error_rate = 0.0;
+				break;
+			case OPTION_FRAMEDELAY:
+				frame_delay = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) frame_delay = 0;
+				break;
+			case OPTION_SEED:
+				seed = strtol(optarg, &endptr, 0);
+				break;
+			case OPTION_PRELOAD:
+				preload_image = optarg;
+				break;
+			case OPTION_EXPECT:
+				expect_image = optarg;
+				break;
+			case OPTION_EXPECTADR:
+				expect_address = strtoul(optarg, &endptr, 0);
+				if(*endptr != 0) expect_address = DEFAULT_RAMADR;
+				break;
+			case OPTION_LINK:
+				link_name = optarg;
+				break;
+		}
+	}
+	srand48(seed);
+	sflemu_uart_divisor = brd_desc->clk_frequency/baudrate/16;
+
+	/* The BIOS code uses device addresses as pointers */
+#ifdef MAP_FIXED_NOREPLACE
+	ram = mmap((void *)(unsigned long)ram_address, ram_size, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0);
+#else
+	ram = mmap((void *)(unsigned long)ram_address, ram_size, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+#endif
+	if(ram != (void *)(unsigned long)ram_address) {
+		fprintf(stderr, "[SFLEMU] Unable to map the emulated RAM at 0x%08x.\n", ram_address);
+		return 1;
+	}
+	if((preload_image != NULL) && !load_file(preload_image, ram_address, ram_size))
+		return 1;
+
+	if(openpty(&masterfd, &slavefd, slave_name, NULL, NULL) < 0) {
+		perror("[SFLEMU] Unable to create pseudo-terminal");
+		return 1;
+	}
+	tcgetattr(masterfd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(masterfd, TCSANOW, &tio);
+	if(link_name != NULL) {
+		unlink(link_name);
+		if(symlink(slave_name, link_name) < 0) {
+			perror("[SFLEMU] Unable to create link");
+			return 1;
+		}
+	}
+	printf("[SFLEMU] Serial port: %s\n", link_name != NULL ? link_name : slave_name);
+	fflush(stdout);
+
+	/* Wait for the host to open the port. The master side reports
+	 * POLLHUP as long as nobody has the slave side open.
+	 */
+	close(slavefd);
+	while(1) {
+		pfd.fd = masterfd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, 0);
+		if(!(pfd.revents & POLLHUP)) break;
+		usleep(10000);
+	}
+	/* Leave time to the host to configure the port */
+	usleep(100000);
+
+	start = now();
+	serialboot();
+
+	fprintf(stderr, "[SFLEMU] Serial boot failed.\n");
+	if(link_name != NULL)
+		unlink(link_name);
+	return 2;
+}
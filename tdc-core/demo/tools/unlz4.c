@@ -0,0 +1,84 @@
+/*
+ * Milkymist SoC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file is built both into the BIOS and into the host tools,
+ * so it must not depend on any library.
+ */
+
+#include "lz4.h"
+
+/* Extends a literal or match length. Returns 0 on truncated input. */
+static int get_length(const unsigned char **ip, const unsigned char *iend, unsigned int *length)
+{
+	unsigned int b;
+
+	do {
+		if(*ip >= iend)
+			return 0;
+		b = *(*ip)++;
+		*length += b;
+	} while(b == 255);
+	return 1;
+}
+
+int lz4_decompress(const unsigned char *src, int srclen, unsigned char *dst, int dstlen)
+{
+	const unsigned char *ip = src;
+	const unsigned char *iend = src + srclen;
+	unsigned char *op = dst;
+	unsigned char *oend = dst + dstlen;
+	const unsigned char *match;
+	unsigned int token;
+	unsigned int length;
+	unsigned int offset;
+
+	while(ip < iend) {
+		token = *ip++;
+
+		/* Literals */
+		length = token >> 4;
+		if((length == 15) && !get_length(&ip, iend, &length))
+			return -1;
+		if((length > (unsigned int)(iend - ip)) || (length > (unsigned int)(oend - op)))
+			return -1;
+		while(length--)
+			*op++ = *ip++;
+
+		/* The last sequence has no match */
+		if(ip == iend)
+			break;
+
+		/* Match */
+		if(iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if((offset == 0) || (offset > (unsigned int)(op - dst)))
+			return -1;
+		length = token & 15;
+		if((length == 15) && !get_length(&ip, iend, &length))
+			return -1;
+		length += 4;
+		if(length > (unsigned int)(oend - op))
+			return -1;
+		/* Byte by byte, as the match may overlap the output */
+		match = op - offset;
+		while(length--)
+			*op++ = *match++;
+	}
+	return op - dst;
+}